@@ -102,6 +102,8 @@ testScripts = [
     'mempool_spendcoinbase.py',
     'mempool_reorg.py',
     'mempool_limit.py',
+    'mempool_persist.py',
+    'p2p-relaycache.py',
     'httpbasics.py',
     'multi_rpc.py',
     'zapwallettxes.py',
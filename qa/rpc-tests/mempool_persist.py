@@ -0,0 +1,82 @@
+#!/usr/bin/env python2
+# Copyright (c) 2017 The Digitalcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test mempool persistence across restarts.
+#
+# node0 sends transactions to itself, node1 only knows them from relay, so
+# its wallet can't put them back into the mempool on its own:
+#  - node1 restarted normally reloads them, with its fee deltas, from mempool.dat
+#  - node1 restarted with -persistmempool=0 starts with an empty mempool and
+#    refuses savemempool, which would overwrite mempool.dat
+#
+
+import time
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.nodes.append(start_node(1, self.options.tmpdir))
+        connect_nodes_bi(self.nodes, 0, 1)
+        self.is_network_split = False
+
+    def wait_for_mempool_size(self, node, size, timeout=30):
+        for _ in xrange(timeout * 10):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.1)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def save_mempool(self, node, timeout=30):
+        # savemempool is refused until the load at startup has finished
+        for _ in xrange(timeout * 10):
+            try:
+                node.savemempool()
+                return
+            except JSONRPCException:
+                time.sleep(0.1)
+        node.savemempool()
+
+    def run_test(self):
+        address = self.nodes[0].getnewaddress()
+        txids = [self.nodes[0].sendtoaddress(address, Decimal("0.1")) for _ in xrange(5)]
+        sync_mempools(self.nodes)
+        assert_equal(len(self.nodes[1].getrawmempool()), 5)
+
+        self.nodes[1].prioritisetransaction(txids[0], 0, 1000)
+        modified_fee = self.nodes[1].getrawmempool(True)[txids[0]]['modifiedfee']
+
+        print("Restart node1, its mempool should be reloaded")
+        stop_node(self.nodes[1], 1)
+        stop_node(self.nodes[0], 0)
+        self.nodes[1] = start_node(1, self.options.tmpdir)
+        self.wait_for_mempool_size(self.nodes[1], 5)
+        assert_equal(set(self.nodes[1].getrawmempool()), set(txids))
+        assert_equal(self.nodes[1].getrawmempool(True)[txids[0]]['modifiedfee'], modified_fee)
+
+        print("Dump with savemempool, restart node1 with -persistmempool=0")
+        self.save_mempool(self.nodes[1])
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, ["-persistmempool=0"])
+        # Give a load that should not happen time to run
+        time.sleep(5)
+        assert_equal(len(self.nodes[1].getrawmempool()), 0)
+        assert_raises(JSONRPCException, self.nodes[1].savemempool)
+
+        print("Restart node1 again, mempool.dat was left untouched")
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir)
+        self.wait_for_mempool_size(self.nodes[1], 5)
+
+        # Bring node0 back so the framework can shut everything down
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
@@ -0,0 +1,94 @@
+#!/usr/bin/env python2
+# Copyright (c) 2017 The Digitalcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test serving getdata requests from the relay cache.
+#
+#  - a relayed transaction is served while it is in the mempool
+#  - it is still served from relay memory after it was mined
+#  - once the relay memory expired it isn't served anymore, the message
+#    serialized for the earlier requests doesn't keep it alive
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+RELAY_CACHE_EXPIRY = 15 * 60
+
+class TestNode(SingleNodeConnCB):
+    def __init__(self):
+        SingleNodeConnCB.__init__(self)
+        self.verack_received = False
+        self.last_tx = None
+        self.last_notfound = None
+
+    def on_verack(self, conn, message):
+        self.verack_received = True
+
+    def on_inv(self, conn, message):
+        pass
+
+    def on_tx(self, conn, message):
+        self.last_tx = message
+
+    def on_notfound(self, conn, message):
+        self.last_notfound = message
+
+    def wait_for_verack(self):
+        assert(wait_until(lambda: self.verack_received, timeout=30))
+
+    # Request txid and return whether the node sent it
+    def request_tx(self, txid):
+        with mininode_lock:
+            self.last_tx = None
+            self.last_notfound = None
+        self.send_message(msg_getdata([CInv(1, int(txid, 16))]))
+        assert(self.sync_with_ping())
+        with mininode_lock:
+            if self.last_tx is not None:
+                self.last_tx.tx.calc_sha256()
+                assert_equal(self.last_tx.tx.hash, txid)
+                return True
+            assert(self.last_notfound is not None)
+            assert_equal(self.last_notfound.inv[0].hash, int(txid, 16))
+            return False
+
+class RelayCacheTest(BitcoinTestFramework):
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug"]))
+        self.is_network_split = False
+
+    def run_test(self):
+        node = self.nodes[0]
+        test_node = TestNode()
+        connection = NodeConn('127.0.0.1', p2p_port(0), node, test_node)
+        test_node.add_connection(connection)
+        NetworkThread().start() # Start up network handling in another thread
+        test_node.wait_for_verack()
+
+        now = int(time.time())
+        node.setmocktime(now)
+        txid = node.sendtoaddress(node.getnewaddress(), Decimal("1"))
+
+        print("Relayed transaction is served from the mempool")
+        assert(test_node.request_tx(txid))
+        assert(test_node.request_tx(txid))
+
+        print("Mined transaction is still served from relay memory")
+        node.generate(1)
+        assert_equal(len(node.getrawmempool()), 0)
+        assert(test_node.request_tx(txid))
+
+        print("Expired transaction is not served anymore")
+        node.setmocktime(now + RELAY_CACHE_EXPIRY + 1)
+        assert(not test_node.request_tx(txid))
+
+        # A transaction we never relayed isn't served either
+        assert(not test_node.request_tx("%064x" % 0x1234))
+
+if __name__ == '__main__':
+    RelayCacheTest().main()
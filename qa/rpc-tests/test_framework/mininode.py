@@ -780,6 +780,22 @@ class msg_getdata(object):
         return "msg_getdata(inv=%s)" % (repr(self.inv))
 
 
+class msg_notfound(object):
+    command = b"notfound"
+
+    def __init__(self, inv=None):
+        self.inv = inv if inv != None else []
+
+    def deserialize(self, f):
+        self.inv = deser_vector(f, CInv)
+
+    def serialize(self):
+        return ser_vector(self.inv)
+
+    def __repr__(self):
+        return "msg_notfound(inv=%s)" % (repr(self.inv))
+
+
 class msg_getblocks(object):
     command = b"getblocks"
 
@@ -1093,6 +1109,7 @@ class NodeConnCB(object):
     def on_addr(self, conn, message): pass
     def on_alert(self, conn, message): pass
     def on_getdata(self, conn, message): pass
+    def on_notfound(self, conn, message): pass
     def on_getblocks(self, conn, message): pass
     def on_tx(self, conn, message): pass
     def on_block(self, conn, message): pass
@@ -1144,6 +1161,7 @@ class NodeConn(asyncore.dispatcher):
         b"alert": msg_alert,
         b"inv": msg_inv,
         b"getdata": msg_getdata,
+        b"notfound": msg_notfound,
         b"getblocks": msg_getblocks,
         b"tx": msg_tx,
         b"block": msg_block,
@@ -0,0 +1,149 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000, 0, 10.0, 1, pool.HasNoInputsOf(*tx),
+                                                     tx->GetValueOut(), false, 1, lp), false);
+}
+
+// Accept a block's worth of transactions, half of them spending the other
+// half, and tear them all down again the way a connected block does.
+static void MempoolAcceptRemove(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vtx;
+    for (uint32_t i = 0; i < 1000; i++) {
+        CMutableTransaction parent;
+        parent.vin.resize(1);
+        parent.vin[0].prevout.n = i;
+        parent.vin[0].scriptSig = CScript() << OP_1;
+        parent.vout.resize(2);
+        parent.vout[0].nValue = 10 * COIN;
+        parent.vout[0].scriptPubKey = CScript() << OP_1;
+        parent.vout[1] = parent.vout[0];
+        vtx.push_back(MakeTransactionRef(parent));
+
+        CMutableTransaction child;
+        child.vin.resize(1);
+        child.vin[0].prevout = COutPoint(vtx.back()->GetHash(), 0);
+        child.vin[0].scriptSig = CScript() << OP_1;
+        child.vout.resize(1);
+        child.vout[0].nValue = 9 * COIN;
+        child.vout[0].scriptPubKey = CScript() << OP_1;
+        vtx.push_back(MakeTransactionRef(child));
+    }
+
+    CTxMemPool pool(CFeeRate(1000));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], pool);
+        std::list<CTransactionRef> conflicts;
+        pool.removeForBlock(vtx, 1, conflicts, false);
+        assert(pool.size() == 0);
+    }
+}
+
+// A single chain of transactions each spending the one before it: every
+// addition walks all of its ancestors and every removal for the block
+// updates the ancestor state of all the descendants left behind.
+static void MempoolLongChain(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vtx;
+    COutPoint prevout(uint256(), 0);
+    for (uint32_t i = 0; i < 500; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = prevout;
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (1000 - i) * COIN;
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        vtx.push_back(MakeTransactionRef(tx));
+        prevout = COutPoint(vtx.back()->GetHash(), 0);
+    }
+
+    CTxMemPool pool(CFeeRate(1000));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], pool);
+        std::list<CTransactionRef> conflicts;
+        pool.removeForBlock(vtx, 1, conflicts, false);
+        assert(pool.size() == 0);
+    }
+}
+
+static void MakeFanOut(std::vector<CTransactionRef>& vChildren, CTransactionRef& parentOut)
+{
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].scriptSig = CScript() << OP_1;
+    parent.vout.resize(1000);
+    for (size_t i = 0; i < parent.vout.size(); i++) {
+        parent.vout[i].nValue = COIN;
+        parent.vout[i].scriptPubKey = CScript() << OP_1;
+    }
+    parentOut = MakeTransactionRef(parent);
+
+    for (uint32_t i = 0; i < parent.vout.size(); i++) {
+        CMutableTransaction child;
+        child.vin.resize(1);
+        child.vin[0].prevout = COutPoint(parentOut->GetHash(), i);
+        child.vin[0].scriptSig = CScript() << OP_1;
+        child.vout.resize(1);
+        child.vout[0].nValue = COIN / 2;
+        child.vout[0].scriptPubKey = CScript() << OP_1;
+        vChildren.push_back(MakeTransactionRef(child));
+    }
+}
+
+// One parent with a thousand children, added and then mined together with
+// all of them.
+static void MempoolWideFanOut(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vtx;
+    CTransactionRef parent;
+    MakeFanOut(vtx, parent);
+    vtx.insert(vtx.begin(), parent);
+
+    CTxMemPool pool(CFeeRate(1000));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vtx.size(); i++)
+            AddTx(vtx[i], pool);
+        std::list<CTransactionRef> conflicts;
+        pool.removeForBlock(vtx, 1, conflicts, false);
+        assert(pool.size() == 0);
+    }
+}
+
+// The same fan-out after a reorg: the children are already in the pool when
+// the disconnected parent comes back and has to be linked up with them.
+static void MempoolReorgFanOut(benchmark::State& state)
+{
+    std::vector<CTransactionRef> vChildren;
+    CTransactionRef parent;
+    MakeFanOut(vChildren, parent);
+    std::vector<uint256> vHashUpdate(1, parent->GetHash());
+
+    CTxMemPool pool(CFeeRate(1000));
+    while (state.KeepRunning()) {
+        for (size_t i = 0; i < vChildren.size(); i++)
+            AddTx(vChildren[i], pool);
+        AddTx(parent, pool);
+        pool.UpdateTransactionsFromBlock(vHashUpdate);
+        assert(pool.size() == vChildren.size() + 1);
+        pool.clear();
+    }
+}
+
+BENCHMARK(MempoolAcceptRemove);
+BENCHMARK(MempoolLongChain);
+BENCHMARK(MempoolWideFanOut);
+BENCHMARK(MempoolReorgFanOut);
@@ -5,6 +5,8 @@
 
 #include "chain.h"
 
+#include "memusage.h"
+
 using namespace std;
 
 /**
@@ -111,3 +113,28 @@ void CBlockIndex::BuildSkip()
     if (pprev)
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
+
+/**
+ * CBlockIndexArena implementation
+ */
+CBlockIndex* CBlockIndexArena::Allocate()
+{
+    if (nSize == vChunks.size() * CHUNK_ENTRIES)
+        vChunks.push_back(static_cast<CBlockIndex*>(::operator new(sizeof(CBlockIndex) * CHUNK_ENTRIES)));
+    return vChunks.back() + (nSize++ % CHUNK_ENTRIES);
+}
+
+void CBlockIndexArena::Clear()
+{
+    for (size_t i = 0; i < nSize; i++)
+        vChunks[i / CHUNK_ENTRIES][i % CHUNK_ENTRIES].~CBlockIndex();
+    for (size_t i = 0; i < vChunks.size(); i++)
+        ::operator delete(vChunks[i]);
+    std::vector<CBlockIndex*>().swap(vChunks);
+    nSize = 0;
+}
+
+size_t CBlockIndexArena::DynamicMemoryUsage() const
+{
+    return memusage::MallocUsage(sizeof(CBlockIndex) * CHUNK_ENTRIES) * vChunks.size() + memusage::DynamicUsage(vChunks);
+}
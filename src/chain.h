@@ -13,6 +13,7 @@
 #include "uint256.h"
 #include "chainparams.h"
 
+#include <new>
 #include <vector>
 
 class CBlockFileInfo
@@ -409,6 +410,41 @@ public:
     const CBlockIndex* GetAncestor(int height) const;
 };
 
+/**
+ * Storage for the entries of mapBlockIndex. Entries are placed in large
+ * contiguous chunks in creation order, which is height order when loading
+ * the index and while following the chain, so pprev and skip list walks
+ * mostly stay within a few pages, and there is no per-entry malloc overhead.
+ * Entries can't be freed individually; their addresses are stable until
+ * Clear().
+ */
+class CBlockIndexArena
+{
+private:
+    static const size_t CHUNK_ENTRIES = 4096;
+
+    std::vector<CBlockIndex*> vChunks;
+    size_t nSize;
+
+    CBlockIndexArena(const CBlockIndexArena&);
+    void operator=(const CBlockIndexArena&);
+
+    CBlockIndex* Allocate();
+
+public:
+    CBlockIndexArena() : nSize(0) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    CBlockIndex* Create() { return new (Allocate()) CBlockIndex(); }
+    CBlockIndex* Create(const CBlockHeader& block) { return new (Allocate()) CBlockIndex(block); }
+
+    //! Destroy all entries
+    void Clear();
+
+    size_t size() const { return nSize; }
+    size_t DynamicMemoryUsage() const;
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -537,4 +573,53 @@ public:
     const CBlockIndex *FindFork(const CBlockIndex *pindex) const;
 };
 
+/**
+ * A chain identified only by its tip. Heights are resolved through the skip
+ * list rather than a vector, so a view costs nothing to take and can be used
+ * without cs_main: pprev, pskip and nHeight never change once an entry is in
+ * the block index.
+ */
+class CChainView {
+private:
+    CBlockIndex *pindexTip;
+
+public:
+    explicit CChainView(CBlockIndex *pindexTipIn = NULL) : pindexTip(pindexTipIn) {}
+
+    /** Returns the index entry for the genesis block of this chain, or NULL if none. */
+    CBlockIndex *Genesis() const {
+        return (*this)[0];
+    }
+
+    /** Returns the index entry for the tip of this chain, or NULL if none. */
+    CBlockIndex *Tip() const {
+        return pindexTip;
+    }
+
+    /** Returns the index entry at a particular height in this chain, or NULL if no such height exists. */
+    CBlockIndex *operator[](int nHeight) const {
+        if (pindexTip == NULL || nHeight < 0 || nHeight > pindexTip->nHeight)
+            return NULL;
+        return pindexTip->GetAncestor(nHeight);
+    }
+
+    /** Check whether a block is present in this chain. */
+    bool Contains(const CBlockIndex *pindex) const {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    /** Find the successor of a block in this chain, or NULL if the given index is not found or is the tip. */
+    CBlockIndex *Next(const CBlockIndex *pindex) const {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        else
+            return NULL;
+    }
+
+    /** Return the maximal height in the chain. Is equal to chain.Tip() ? chain.Tip()->nHeight : -1. */
+    int Height() const {
+        return pindexTip ? pindexTip->nHeight : -1;
+    }
+};
+
 #endif // BITCOIN_CHAIN_H
@@ -119,6 +119,8 @@ struct CCoinsCacheEntry
     explicit CCoinsCacheEntry(Coin&& coin_) : coin(std::move(coin_)), flags(0) {}
 };
 
+/** Uses the default allocator: CNodePool isn't thread-safe, and maps handed to
+ *  CCoinsViewDB::BatchWrite are released on its writer thread. */
 typedef std::unordered_map<COutPoint, CCoinsCacheEntry, SaltedOutpointHasher> CCoinsMap;
 
 /** Cursor for iterating over CoinsView state */
@@ -257,12 +259,26 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base like Flush(),
+     * but keep the unspent entries cached (now clean) so lookups after a
+     * periodic write don't all go back to the base view.
+     */
+    bool Sync();
+
     /**
      * Removes the UTXO with the given outpoint from the cache, if it is
      * not modified.
      */
     void Uncache(const COutPoint &outpoint);
 
+    /**
+     * Add an unspent coin that was read from the base view elsewhere, as if
+     * FetchCoin had loaded it. Does nothing if the outpoint is cached already.
+     * The caller must make sure the coin is still what the base view holds.
+     */
+    void CacheCoin(const COutPoint &outpoint, Coin&& coin);
+
     //! Calculate the size of the cache (in number of transaction outputs)
     unsigned int GetCacheSize() const;
 
@@ -5,10 +5,13 @@
 
 #include "compressor.h"
 
+#include "amount.h"
 #include "hash.h"
 #include "pubkey.h"
 #include "script/standard.h"
 
+#include <boost/foreach.hpp>
+
 bool CScriptCompressor::IsToKeyID(CKeyID &hash) const
 {
     if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160
@@ -183,3 +186,14 @@ uint64_t CTxOutCompressor::DecompressAmount(uint64_t x)
     }
     return n;
 }
+
+bool CTxCompressor::CanCompress(const CTransaction &tx)
+{
+    BOOST_FOREACH(const CTxOut &txout, tx.vout) {
+        // CScriptCompressor replaces overly long scripts, and amounts
+        // only round-trip through CompressAmount when they are in range
+        if (txout.scriptPubKey.size() > MAX_SCRIPT_SIZE || !MoneyRange(txout.nValue))
+            return false;
+    }
+    return true;
+}
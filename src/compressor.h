@@ -6,6 +6,7 @@
 #ifndef BITCOIN_COMPRESSOR_H
 #define BITCOIN_COMPRESSOR_H
 
+#include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "serialize.h"
@@ -126,4 +127,138 @@ public:
     }
 };
 
+/** wrapper for CMutableTransaction that provides a more compact serialization
+ *
+ *  Integer fields are stored as VARINTs (nSequence inverted, so the common
+ *  final value takes a single byte) and outputs use CTxOutCompressor.
+ *  Use CanCompress first: not every transaction survives the round trip.
+ */
+class CTxCompressor
+{
+private:
+    CMutableTransaction &tx;
+
+public:
+    CTxCompressor(CMutableTransaction &txIn) : tx(txIn) { }
+
+    static bool CanCompress(const CTransaction &tx);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint32_t nTxVersion = tx.nVersion;
+        READWRITE(VARINT(nTxVersion));
+        tx.nVersion = nTxVersion;
+
+        uint64_t nInputs = tx.vin.size();
+        READWRITE(COMPACTSIZE(nInputs));
+        for (uint64_t i = 0; i < nInputs; i++) {
+            if (ser_action.ForRead())
+                tx.vin.push_back(CTxIn());
+            CTxIn &txin = tx.vin[i];
+            READWRITE(txin.prevout.hash);
+            READWRITE(VARINT(txin.prevout.n));
+            READWRITE(*(CScriptBase*)(&txin.scriptSig));
+            uint32_t nSequenceInv = ~txin.nSequence;
+            READWRITE(VARINT(nSequenceInv));
+            txin.nSequence = ~nSequenceInv;
+        }
+
+        uint64_t nOutputs = tx.vout.size();
+        READWRITE(COMPACTSIZE(nOutputs));
+        for (uint64_t i = 0; i < nOutputs; i++) {
+            if (ser_action.ForRead())
+                tx.vout.push_back(CTxOut());
+            CTxOutCompressor txout(tx.vout[i]);
+            READWRITE(txout);
+        }
+
+        READWRITE(VARINT(tx.nLockTime));
+    }
+};
+
+/** Takes the place of nVersion at the start of a compressed block record */
+static const uint32_t COMPRESSED_BLOCK_MARKER = 0xffffffff;
+
+/** Upper bound on the compressed record of a block that takes at most
+ *  nMaxBlockSize bytes in the network format. Only the marker and one flag
+ *  per transaction are added, as a transaction is never compressed into more
+ *  bytes, and a valid transaction takes at least 60 bytes.
+ */
+inline unsigned int MaxCompressedBlockSize(unsigned int nMaxBlockSize)
+{
+    return nMaxBlockSize + sizeof(COMPRESSED_BLOCK_MARKER) + nMaxBlockSize / 60;
+}
+
+/** wrapper for blocks stored in the blk?????.dat files
+ *
+ *  Blocks are written either in the network format or, when fCompress is
+ *  set, as COMPRESSED_BLOCK_MARKER followed by the header and the
+ *  transactions, each behind a flag saying whether it uses CTxCompressor or
+ *  the network format, whichever is smaller. Reading accepts both, so the
+ *  two can be mixed in one file. Any block can be written compressed, and one
+ *  whose nVersion equals the marker has to be.
+ *
+ *  This is a structural encoding rather than a general purpose codec: most
+ *  of a block is hashes, keys and signatures that don't compress, the rest
+ *  is fixed width integers and standard scripts, which is what the UTXO set
+ *  and undo encodings already shrink.
+ */
+class CBlockCompressor
+{
+private:
+    CBlock &block;
+    bool fCompress;
+
+public:
+    CBlockCompressor(CBlock &blockIn, bool fCompressIn = false) : block(blockIn), fCompress(fCompressIn) { }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint32_t nMarker = fCompress ? COMPRESSED_BLOCK_MARKER : (uint32_t)block.nVersion;
+        READWRITE(nMarker);
+        if (ser_action.ForRead())
+            fCompress = (nMarker == COMPRESSED_BLOCK_MARKER);
+
+        if (!fCompress) {
+            // Network format, the marker was nVersion (see CBlockHeader)
+            block.nVersion = nMarker;
+            READWRITE(block.hashPrevBlock);
+            READWRITE(block.hashMerkleRoot);
+            READWRITE(block.nTime);
+            READWRITE(block.nBits);
+            READWRITE(block.nNonce);
+            READWRITE(block.vtx);
+            return;
+        }
+
+        READWRITE(*(CBlockHeader*)&block);
+        uint64_t nTx = block.vtx.size();
+        READWRITE(COMPACTSIZE(nTx));
+        for (uint64_t i = 0; i < nTx; i++) {
+            CMutableTransaction tx;
+            unsigned char fCompressed = 0;
+            if (!ser_action.ForRead()) {
+                // VARINTs of large values are longer than the fixed width
+                // fields, keep the network format when it's not larger
+                tx = CMutableTransaction(*block.vtx[i]);
+                fCompressed = CTxCompressor::CanCompress(*block.vtx[i]) &&
+                    ::GetSerializeSize(CTxCompressor(tx), nType, nVersion) <= ::GetSerializeSize(*block.vtx[i], nType, nVersion);
+            }
+            READWRITE(fCompressed);
+            if (fCompressed) {
+                CTxCompressor txc(tx);
+                READWRITE(txc);
+            } else {
+                READWRITE(tx);
+            }
+            if (ser_action.ForRead())
+                block.vtx.push_back(MakeTransactionRef(std::move(tx)));
+        }
+    }
+};
+
 #endif // BITCOIN_COMPRESSOR_H
@@ -53,8 +53,8 @@ void CDSNotificationInterface::UpdatedBlockTip(const CBlockIndex *pindexNew, con
     governance.UpdatedBlockTip(pindexNew, connman);
 }
 
-void CDSNotificationInterface::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+void CDSNotificationInterface::SyncTransaction(const CTransactionRef &ptx, const CBlock *pblock)
 {
-    instantsend.SyncTransaction(tx, pblock);
-    CPrivateSend::SyncTransaction(tx, pblock);
+    instantsend.SyncTransaction(*ptx, pblock);
+    CPrivateSend::SyncTransaction(*ptx, pblock);
 }
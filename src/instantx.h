@@ -94,8 +94,14 @@ public:
     void RejectLockRequest(const CTxLockRequest& txLockRequest);
     bool HasTxLockRequest(const uint256& txHash);
     bool GetTxLockRequest(const uint256& txHash, CTxLockRequest& txLockRequestRet);
+    // transactions of all known lock requests, used to reconstruct compact blocks
+    std::vector<CTransactionRef> GetTxLockRequestTransactions();
 
     bool GetTxLockVote(const uint256& hash, CTxLockVote& txLockVoteRet);
+    // all votes collected for the lock request of a transaction, for mempool.dat
+    std::vector<CTxLockVote> GetTxLockVotes(const uint256& txHash);
+    // recreate a lock candidate and its votes read back from mempool.dat
+    bool RestoreTxLock(const CTxLockRequest& txLockRequest, const std::vector<CTxLockVote>& vecVotes);
 
     bool GetLockedOutPointTxHash(const COutPoint& outpoint, uint256& hashRet);
 
@@ -119,7 +125,7 @@ public:
     std::string ToString();
 };
 
-class CTxLockRequest : public CTransaction
+class CTxLockRequest
 {
 private:
     static const CAmount MIN_FEE            = 0.0001 * COIN;
@@ -127,8 +133,21 @@ private:
 public:
     static const int WARN_MANY_INPUTS       = 100;
 
-    CTxLockRequest() = default;
-    CTxLockRequest(const CTransaction& tx) : CTransaction(tx) {};
+    // shared with the mempool and the relay cache, serialized exactly like the bare transaction
+    CTransactionRef tx;
+
+    CTxLockRequest() : tx(MakeTransactionRef()) {};
+    CTxLockRequest(const CTransaction& _tx) : tx(MakeTransactionRef(_tx)) {};
+    CTxLockRequest(const CTransactionRef& _tx) : tx(_tx) {};
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(tx);
+    }
+
+    const uint256& GetHash() const { return tx->GetHash(); }
 
     bool IsValid() const;
     CAmount GetMinFee() const;
@@ -136,7 +155,7 @@ public:
 
     explicit operator bool() const
     {
-        return *this != CTxLockRequest();
+        return tx && *tx != CTransaction();
     }
 };
 
@@ -19,6 +19,7 @@
 #include "primitives/transaction.h"
 #include "netbase.h"
 #include "scheduler.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "utilstrencodings.h"
 
@@ -31,6 +32,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -81,9 +83,8 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 std::string strSubVersion;
 
-std::map<CInv, CDataStream> mapRelay;
-std::deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache;
+CNetRecvBufferPool recvBufferPool;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 // Signals for message handling
@@ -668,6 +669,13 @@ void CNode::copyStats(CNodeStats &stats)
     stats.dMinPing  = (((double)nMinPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
 
+    {
+        LOCK(cs_inventory);
+        stats.nInvQueueSize = vInventoryTxToSend.size();
+        stats.dInvLatency = nInvTxSent ? (((double)nInvTxLatency) / nInvTxSent / 1e6) : 0.0;
+        stats.nInvDropped = nInvTxDropped;
+    }
+
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
 }
@@ -684,7 +692,7 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& complete
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION));
+            vRecvMsg.emplace_back(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -776,6 +784,11 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // payload goes straight into a recycled buffer, only trust the header for part of it up front
+    CSerializeData data;
+    recvBufferPool.Get(data, std::min(hdr.nMessageSize, MAX_RECV_RESERVE));
+    vRecv.SwapData(data);
+
     // switch state to reading message data
     in_data = true;
 
@@ -787,17 +800,76 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    if (vRecv.capacity() < nDataPos + nCopy) {
+        // Grow geometrically with the data actually received, but never past the total message size.
+        vRecv.reserve(std::min((size_t)hdr.nMessageSize, std::max((size_t)nDataPos + nCopy, 2 * vRecv.capacity())));
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    vRecv.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+CNetMessage::~CNetMessage()
+{
+    CSerializeData data;
+    vRecv.SwapData(data);
+    recvBufferPool.Put(data);
+}
+
+void CNetRecvBufferPool::Get(CSerializeData& data, size_t nReserve)
+{
+    {
+        LOCK(cs);
+        // Smallest buffer that is large enough, or the largest one we have
+        std::vector<CSerializeData>::iterator itBest = vBuffers.end();
+        for (std::vector<CSerializeData>::iterator it = vBuffers.begin(); it != vBuffers.end(); ++it) {
+            if (itBest == vBuffers.end()) {
+                itBest = it;
+                continue;
+            }
+            bool fFits = it->capacity() >= nReserve;
+            bool fBestFits = itBest->capacity() >= nReserve;
+            if (fFits != fBestFits ? fFits : (fFits ? it->capacity() < itBest->capacity() : it->capacity() > itBest->capacity()))
+                itBest = it;
+        }
+        if (itBest != vBuffers.end()) {
+            nPooledSize -= itBest->capacity();
+            data.swap(*itBest);
+            std::swap(*itBest, vBuffers.back());
+            vBuffers.pop_back();
+        }
+    }
+    data.clear();
+    data.reserve(nReserve);
+}
+
+void CNetRecvBufferPool::Put(CSerializeData& data)
+{
+    if (data.capacity() == 0)
+        return;
+    LOCK(cs);
+    if (vBuffers.size() >= MAX_RECV_POOL_BUFFERS || nPooledSize + data.capacity() > MAX_RECV_POOL_SIZE)
+        return;
+    data.clear();
+    nPooledSize += data.capacity();
+    vBuffers.push_back(CSerializeData());
+    vBuffers.back().swap(data);
+}
+
+size_t CNetRecvBufferPool::Size() const
+{
+    LOCK(cs);
+    return vBuffers.size();
+}
+
+size_t CNetRecvBufferPool::PooledSize() const
+{
+    LOCK(cs);
+    return nPooledSize;
+}
+
 
 
 
@@ -809,25 +881,53 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 size_t CConnman::SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
+        size_t nToSend = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather the unsent part of the queue into a single system call
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nToSend = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSerializedNetMsg>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < (int)MAX_SEND_IOV; ++itIov, ++nIov) {
+            iov[nIov].iov_base = (void*)((*itIov)->data() + nOffset);
+            iov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nToSend += iov[nIov].iov_len;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nRemaining = nBytes;
+            while (nRemaining > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nRemaining < nLeft) {
+                    pnode->nSendOffset += nRemaining;
+                    break;
+                }
+                nRemaining -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything we offered; stop sending more
                 break;
             }
         } else {
@@ -2475,40 +2575,22 @@ bool CConnman::DisconnectNode(NodeId id)
 
 void CConnman::RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    uint256 hash = tx.GetHash();
-    CTxLockRequest txLockRequest;
-    CDarksendBroadcastTx dstx = CPrivateSend::GetDSTX(hash);
-    if(dstx) { // MSG_DSTX
-        ss << dstx;
-    } else if(instantsend.GetTxLockRequest(hash, txLockRequest)) { // MSG_TXLOCK_REQUEST
-        ss << txLockRequest;
-    } else { // MSG_TX
-        ss << tx;
-    }
-    RelayTransaction(tx, ss);
+    // Share the mempool's copy when there is one instead of keeping another
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    RelayTransaction(ptx ? ptx : MakeTransactionRef(tx));
 }
 
-void CConnman::RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void CConnman::RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     uint256 hash = tx.GetHash();
     int nInv = static_cast<bool>(CPrivateSend::GetDSTX(hash)) ? MSG_DSTX :
                 (instantsend.HasTxLockRequest(hash) ? MSG_TXLOCK_REQUEST : MSG_TX);
     CInv inv(nInv, hash);
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
-    }
+    // A lock request serializes exactly like its transaction, so both can be
+    // served from the shared reference. DSTX messages carry masternode fields
+    // on top and are served from mapDSTX instead.
+    relayCache.Insert(inv, nInv != MSG_DSTX ? ptx : CTransactionRef(), GetTime());
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -2525,6 +2607,8 @@ void CConnman::RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 }
 
 void CConnman::RelayInv(CInv &inv, const int minProtoVersion) {
+    // Lets the peers fetching it share one serialized message
+    relayCache.Insert(inv, CTransactionRef(), GetTime());
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
         if(pnode->nVersion >= minProtoVersion)
@@ -2700,6 +2784,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nNextLocalAddrSend = 0;
     nNextAddrSend = 0;
     nNextInvSend = 0;
+    nInvTxSent = 0;
+    nInvTxLatency = 0;
+    nInvTxDropped = 0;
     fRelayTxes = false;
     pfilter = new CBloomFilter();
     nLastBlockTime = 0;
@@ -2741,6 +2828,29 @@ CNode::~CNode()
         delete pfilter;
 }
 
+bool CNode::IsInventoryTxImmediate(const uint256& hash)
+{
+    static const uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    static const uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+    return (SipHashUint256(k0, k1, hash) & 3) == 0;
+}
+
+void CNode::TakeInventoryTxBatch(std::vector<CInv>& vInv, int64_t nNow)
+{
+    AssertLockHeld(cs_inventory);
+    BOOST_FOREACH(const PAIRTYPE(uint256, int64_t)& queued, vInventoryTxToSend)
+    {
+        // Queued twice, or the peer announced it to us in the meantime
+        if (filterInventoryKnown.contains(queued.first))
+            continue;
+        filterInventoryKnown.insert(queued.first);
+        nInvTxSent++;
+        nInvTxLatency += nNow - queued.second;
+        vInv.push_back(CInv(MSG_TX, queued.first));
+    }
+    vInventoryTxToSend.clear();
+}
+
 void CNode::AskFor(const CInv& inv)
 {
     if (mapAskFor.size() > MAPASKFOR_MAX_SZ || setAskFor.size() > SETASKFOR_MAX_SZ) {
@@ -2815,7 +2925,12 @@ std::vector<unsigned char> CNode::CalculateKeyedNetGroup(CAddress& address)
 
 CDataStream CConnman::BeginMessage(CNode* pnode, int nVersion, int flags, const std::string& sCommand)
 {
-    return {SER_NETWORK, (nVersion ? nVersion : pnode->GetSendVersion()) | flags, CMessageHeader(Params().MessageStart(), sCommand.c_str(), 0) };
+    return BeginMessage((nVersion ? nVersion : pnode->GetSendVersion()) | flags, sCommand);
+}
+
+CDataStream CConnman::BeginMessage(int nVersion, const std::string& sCommand)
+{
+    return {SER_NETWORK, nVersion, CMessageHeader(Params().MessageStart(), sCommand.c_str(), 0) };
 }
 
 void CConnman::EndMessage(CDataStream& strm)
@@ -2830,12 +2945,28 @@ void CConnman::EndMessage(CDataStream& strm)
 
 }
 
+CSerializedNetMsg CConnman::ShareMessage(CDataStream& strm)
+{
+    // Take over the stream's buffer instead of copying it
+    CSerializeData data;
+    strm.SwapData(data);
+    return std::make_shared<const CSerializeData>(std::move(data));
+}
+
 void CConnman::PushMessage(CNode* pnode, CDataStream& strm, const std::string& sCommand)
 {
     if(strm.empty())
         return;
 
-    unsigned int nSize = strm.size() - CMessageHeader::HEADER_SIZE;
+    PushMessage(pnode, ShareMessage(strm), sCommand);
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSerializedNetMsg& msg, const std::string& sCommand)
+{
+    if(!msg || msg->empty())
+        return;
+
+    unsigned int nSize = msg->size() - CMessageHeader::HEADER_SIZE;
     LogPrint("net", "sending %s (%d bytes) peer=%d\n",  SanitizeString(sCommand.c_str()), nSize, pnode->id);
 
     size_t nBytesSent = 0;
@@ -2845,11 +2976,11 @@ void CConnman::PushMessage(CNode* pnode, CDataStream& strm, const std::string& s
             return;
         }
         bool optimisticSend(pnode->vSendMsg.empty());
-        pnode->vSendMsg.emplace_back(strm.begin(), strm.end());
+        pnode->vSendMsg.push_back(msg);
 
         //log total amount of bytes per command
-        pnode->mapSendBytesPerMsgCmd[sCommand] += strm.size();
-        pnode->nSendSize += strm.size();
+        pnode->mapSendBytesPerMsgCmd[sCommand] += msg->size();
+        pnode->nSendSize += msg->size();
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
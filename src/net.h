@@ -12,8 +12,10 @@
 #include "compat.h"
 #include "limitedmap.h"
 #include "netaddress.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
+#include "relaycache.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
@@ -53,10 +55,22 @@ static const int WARNING_INTERVAL = 10 * 60;
 static const int FEELER_INTERVAL = 120;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** The maximum number of transactions queued for the next inventory batch of a single peer.
+ *  Batches go out every AVG_INVENTORY_BROADCAST_INTERVAL seconds on average, so this allows
+ *  bursts of about 1000 tx/s, far above what blocks can confirm, at 40 bytes per entry. */
+static const unsigned int MAX_INV_TX_QUEUE = 5000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
 /** Maximum length of incoming protocol messages (no message over 3 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 3 * 1024 * 1024;
+/** Maximum part of an incoming message payload reserved from its header before the data arrives */
+static const unsigned int MAX_RECV_RESERVE = 256 * 1024;
+/** Maximum number of processed message buffers kept around for reuse */
+static const unsigned int MAX_RECV_POOL_BUFFERS = 64;
+/** Maximum total capacity of the processed message buffers kept around for reuse */
+static const size_t MAX_RECV_POOL_SIZE = 2 * MAX_PROTOCOL_MESSAGE_LENGTH;
+/** Maximum number of queued messages handed to the socket in a single send call */
+static const unsigned int MAX_SEND_IOV = 64;
 /** Maximum length of strSubVer in `version` message */
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** Maximum number of outgoing nodes */
@@ -201,6 +215,18 @@ public:
         PushMessageWithVersionAndFlag(pnode, 0, 0, sCommand, std::forward<Args>(args)...);
     }
 
+    /** Serialize a message once, to be queued for any number of peers with PushMessage */
+    template <typename... Args>
+    CSerializedNetMsg MakeMessage(int nVersion, const std::string& sCommand, Args&&... args)
+    {
+        auto msg(BeginMessage(nVersion, sCommand));
+        ::SerializeMany(msg, msg.nType, msg.nVersion, std::forward<Args>(args)...);
+        EndMessage(msg);
+        return ShareMessage(msg);
+    }
+
+    void PushMessage(CNode* pnode, const CSerializedNetMsg& msg, const std::string& sCommand);
+
     template<typename Condition, typename Callable>
     bool ForEachNodeContinueIf(const Condition& cond, Callable&& func)
     {
@@ -304,8 +330,8 @@ public:
     std::vector<CNode*> CopyNodeVector();
     void ReleaseNodeVector(const std::vector<CNode*>& vecNodes);
 
+    void RelayTransaction(const CTransactionRef& ptx);
     void RelayTransaction(const CTransaction& tx);
-    void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
     void RelayInv(CInv &inv, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
 
     // Addrman functions
@@ -430,8 +456,10 @@ private:
     void DumpBanlist();
 
     CDataStream BeginMessage(CNode* node, int nVersion, int flags, const std::string& sCommand);
+    CDataStream BeginMessage(int nVersion, const std::string& sCommand);
     void PushMessage(CNode* pnode, CDataStream& strm, const std::string& sCommand);
     void EndMessage(CDataStream& strm);
+    static CSerializedNetMsg ShareMessage(CDataStream& strm);
 
     // Network stats
     void RecordBytesRecv(uint64_t bytes);
@@ -571,9 +599,7 @@ extern bool fDiscover;
 extern bool fListen;
 extern bool fRelayTxes;
 
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+extern CRelayCache relayCache;
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
 
 /** Subversion as sent to the P2P network in `version` messages */
@@ -611,6 +637,9 @@ public:
     double dPingTime;
     double dPingWait;
     double dMinPing;
+    size_t nInvQueueSize;
+    double dInvLatency;
+    uint64_t nInvDropped;
     std::string addrLocal;
     CAddress addr;
 };
@@ -618,6 +647,32 @@ public:
 
 
 
+/**
+ * Storage of processed messages, recycled for the payloads of new ones so that
+ * block and masternode/governance sync bursts do not hit the allocator for
+ * every message.
+ */
+class CNetRecvBufferPool
+{
+private:
+    mutable CCriticalSection cs;
+    std::vector<CSerializeData> vBuffers;
+    size_t nPooledSize;
+
+public:
+    CNetRecvBufferPool() : nPooledSize(0) {}
+
+    //! Hand out an empty buffer with at least nReserve bytes of capacity, preferring the best fitting pooled one
+    void Get(CSerializeData& data, size_t nReserve);
+    //! Take back the storage of data for reuse, unless the pool is full
+    void Put(CSerializeData& data);
+
+    size_t Size() const;
+    size_t PooledSize() const;
+};
+
+extern CNetRecvBufferPool recvBufferPool;
+
 class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
@@ -639,6 +694,8 @@ public:
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -669,7 +726,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     CCriticalSection cs_vProcessMsg;
@@ -739,6 +796,16 @@ public:
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // Transactions waiting for the next inventory batch to this peer, in relay
+    // order, with the time (in microseconds) they were queued.
+    // Also protected by cs_inventory
+    std::vector<std::pair<uint256, int64_t> > vInventoryTxToSend;
+    // Batched transaction announcements: count, summed queueing delay (in
+    // microseconds) and announcements dropped because the queue was full.
+    // Also protected by cs_inventory
+    uint64_t nInvTxSent;
+    int64_t nInvTxLatency;
+    uint64_t nInvTxDropped;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -867,15 +934,39 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (inv.type == MSG_TX && filterInventoryKnown.contains(inv.hash)) {
-                LogPrint("net", "PushInventory --  filtered inv: %s peer=%d\n", inv.ToString(), id);
-                return;
+            if (inv.type == MSG_TX) {
+                if (filterInventoryKnown.contains(inv.hash)) {
+                    LogPrint("net", "PushInventory --  filtered inv: %s peer=%d\n", inv.ToString(), id);
+                    return;
+                }
+                if (!IsInventoryTxImmediate(inv.hash)) {
+                    if (vInventoryTxToSend.size() >= MAX_INV_TX_QUEUE) {
+                        LogPrint("net", "PushInventory --  queue full, dropped inv: %s peer=%d\n", inv.ToString(), id);
+                        nInvTxDropped++;
+                        return;
+                    }
+                    vInventoryTxToSend.push_back(std::make_pair(inv.hash, GetTimeMicros()));
+                    return;
+                }
             }
             LogPrint("net", "PushInventory --  inv: %s peer=%d\n", inv.ToString(), id);
             vInventoryToSend.push_back(inv);
         }
     }
 
+    /**
+     * Whether a transaction is announced on the next pass instead of in the
+     * next batch. A salted quarter of all transactions is, the same one for
+     * every peer, so that they still spread quickly.
+     */
+    static bool IsInventoryTxImmediate(const uint256& hash);
+
+    /**
+     * Append the batched transactions the peer doesn't know about yet to
+     * vInv, in relay order, and mark them known. Requires cs_inventory.
+     */
+    void TakeInventoryTxBatch(std::vector<CInv>& vInv, int64_t nNow);
+
     void PushBlockHash(const uint256 &hash)
     {
         LOCK(cs_inventory);
@@ -127,12 +127,13 @@ class CBlock : public CBlockHeader
 {
 public:
     // network and disk
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
 
     // memory only
     mutable CTxOut txoutMasternode; // masternode payment
     mutable std::vector<CTxOut> voutSuperblock; // superblock payment
     mutable bool fChecked;
+    mutable bool fPrechecked; // proof of work, merkle root and transactions already checked
 
     CBlock()
     {
@@ -160,6 +161,7 @@ public:
         txoutMasternode = CTxOut();
         voutSuperblock.clear();
         fChecked = false;
+        fPrechecked = false;
     }
 
     CBlockHeader GetBlockHeader() const
@@ -37,11 +37,9 @@ void CPrivateSendClient::ProcessMessage(CNode* pfrom, std::string& strCommand, C
         vRecv >> dsq;
 
         // process every dsq only once
-        BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue) {
-            if(q == dsq) {
-                // LogPrint("privatesend", "DSQUEUE -- %s seen\n", dsq.ToString());
-                return;
-            }
+        if(darksendQueues.Has(dsq)) {
+            // LogPrint("privatesend", "DSQUEUE -- %s seen\n", dsq.ToString());
+            return;
         }
 
         LogPrint("privatesend", "DSQUEUE -- %s new\n", dsq.ToString());
@@ -70,12 +68,10 @@ void CPrivateSendClient::ProcessMessage(CNode* pfrom, std::string& strCommand, C
                 SubmitDenominate(connman);
             }
         } else {
-            BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue) {
-                if(q.vin == dsq.vin) {
-                    // no way same mn can send another "not yet ready" dsq this soon
-                    LogPrint("privatesend", "DSQUEUE -- Masternode %s is sending WAY too many dsq messages\n", infoMn.addr.ToString());
-                    return;
-                }
+            if(darksendQueues.HasMasternode(dsq.vin.prevout)) {
+                // no way same mn can send another "not yet ready" dsq this soon
+                LogPrint("privatesend", "DSQUEUE -- Masternode %s is sending WAY too many dsq messages\n", infoMn.addr.ToString());
+                return;
             }
 
             int nThreshold = infoMn.nLastDsq + mnodeman.CountEnabled(MIN_PRIVATESEND_PEER_PROTO_VERSION)/5;
@@ -92,7 +88,7 @@ void CPrivateSendClient::ProcessMessage(CNode* pfrom, std::string& strCommand, C
             if(infoMixingMasternode.fInfoValid && infoMixingMasternode.vin.prevout == dsq.vin.prevout) {
                 dsq.fTried = true;
             }
-            vecDarksendQueue.push_back(dsq);
+            darksendQueues.Add(dsq);
             dsq.Relay(connman);
         }
 
@@ -832,12 +828,9 @@ bool CPrivateSendClient::DoAutomaticDenominating(CConnman& connman, bool fDryRun
 bool CPrivateSendClient::JoinExistingQueue(CAmount nBalanceNeedsAnonymized, CConnman& connman)
 {
     std::vector<CAmount> vecStandardDenoms = CPrivateSend::GetStandardDenominations();
-    // Look through the queues and see if anything matches
-    BOOST_FOREACH(CDarksendQueue& dsq, vecDarksendQueue) {
-        // only try each queue once
-        if(dsq.fTried) continue;
-        dsq.fTried = true;
-
+    // Look through the queues and see if anything matches, only try each queue once
+    CDarksendQueue dsq;
+    while(darksendQueues.PopUntried(dsq)) {
         if(dsq.IsExpired()) continue;
 
         masternode_info_t infoMn;
@@ -856,7 +849,7 @@ bool CPrivateSendClient::JoinExistingQueue(CAmount nBalanceNeedsAnonymized, CCon
         }
 
         // mixing rate limit i.e. nLastDsq check should already pass in DSQUEUE ProcessMessage
-        // in order for dsq to get into vecDarksendQueue, so we should be safe to mix already,
+        // in order for dsq to get into darksendQueues, so we should be safe to mix already,
         // no need for additional verification here
 
         LogPrint("privatesend", "CPrivateSendClient::JoinExistingQueue -- found valid queue: %s\n", dsq.ToString());
@@ -84,11 +84,9 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
         vRecv >> dsq;
 
         // process every dsq only once
-        BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue) {
-            if(q == dsq) {
-                // LogPrint("privatesend", "DSQUEUE -- %s seen\n", dsq.ToString());
-                return;
-            }
+        if(darksendQueues.Has(dsq)) {
+            // LogPrint("privatesend", "DSQUEUE -- %s seen\n", dsq.ToString());
+            return;
         }
 
         LogPrint("privatesend", "DSQUEUE -- %s new\n", dsq.ToString());
@@ -105,12 +103,10 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
         }
 
         if(!dsq.fReady) {
-            BOOST_FOREACH(CDarksendQueue q, vecDarksendQueue) {
-                if(q.vin == dsq.vin) {
-                    // no way same mn can send another "not yet ready" dsq this soon
-                    LogPrint("privatesend", "DSQUEUE -- Masternode %s is sending WAY too many dsq messages\n", mnInfo.addr.ToString());
-                    return;
-                }
+            if(darksendQueues.HasMasternode(dsq.vin.prevout)) {
+                // no way same mn can send another "not yet ready" dsq this soon
+                LogPrint("privatesend", "DSQUEUE -- Masternode %s is sending WAY too many dsq messages\n", mnInfo.addr.ToString());
+                return;
             }
 
             int nThreshold = mnInfo.nLastDsq + mnodeman.CountEnabled(MIN_PRIVATESEND_PEER_PROTO_VERSION)/5;
@@ -123,7 +119,7 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
             mnodeman.AllowMixing(dsq.vin.prevout);
 
             LogPrint("privatesend", "DSQUEUE -- new PrivateSend queue (%s) from masternode %s\n", dsq.ToString(), mnInfo.addr.ToString());
-            vecDarksendQueue.push_back(dsq);
+            darksendQueues.Add(dsq);
             dsq.Relay(connman);
         }
 
@@ -168,6 +164,10 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
 
         //check it like a transaction
         {
+            // hold cs_main across the whole entry so the input lookups and
+            // the mempool check see one consistent view of the UTXO set
+            LOCK(cs_main);
+
             CAmount nValueIn = 0;
             CAmount nValueOut = 0;
 
@@ -212,15 +212,12 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
                 return;
             }
 
-            {
-                LOCK(cs_main);
-                CValidationState validationState;
-                mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), 1000, 0.1*COIN);
-                if(!AcceptToMemoryPool(mempool, validationState, CTransaction(tx), false, NULL, false, true, true)) {
-                    LogPrintf("DSVIN -- transaction not valid! tx=%s", tx.ToString());
-                    PushStatus(pfrom, STATUS_REJECTED, ERR_INVALID_TX, connman);
-                    return;
-                }
+            CValidationState validationState;
+            mempool.PrioritiseTransaction(tx.GetHash(), tx.GetHash().ToString(), 1000, 0.1*COIN);
+            if(!AcceptToMemoryPool(mempool, validationState, CTransaction(tx), false, NULL, false, true, true)) {
+                LogPrintf("DSVIN -- transaction not valid! tx=%s", tx.ToString());
+                PushStatus(pfrom, STATUS_REJECTED, ERR_INVALID_TX, connman);
+                return;
             }
         }
 
@@ -248,18 +245,12 @@ void CPrivateSendServer::ProcessMessage(CNode* pfrom, std::string& strCommand, C
 
         LogPrint("privatesend", "DSSIGNFINALTX -- vecTxIn.size() %s\n", vecTxIn.size());
 
-        int nTxInIndex = 0;
-        int nTxInsCount = (int)vecTxIn.size();
-
-        BOOST_FOREACH(const CTxIn txin, vecTxIn) {
-            nTxInIndex++;
-            if(!AddScriptSig(txin)) {
-                LogPrint("privatesend", "DSSIGNFINALTX -- AddScriptSig() failed at %d/%d, session: %d\n", nTxInIndex, nTxInsCount, nSessionID);
-                RelayStatus(STATUS_REJECTED, connman);
-                return;
-            }
-            LogPrint("privatesend", "DSSIGNFINALTX -- AddScriptSig() %d/%d success\n", nTxInIndex, nTxInsCount);
+        if(!AddScriptSigs(vecTxIn)) {
+            LogPrint("privatesend", "DSSIGNFINALTX -- AddScriptSigs() failed, session: %d\n", nSessionID);
+            RelayStatus(STATUS_REJECTED, connman);
+            return;
         }
+        LogPrint("privatesend", "DSSIGNFINALTX -- AddScriptSigs() %d inputs success\n", vecTxIn.size());
         // all is good
         CheckPool(connman);
     }
@@ -269,6 +260,7 @@ void CPrivateSendServer::SetNull()
 {
     // MN side
     vecSessionCollaterals.clear();
+    mapFinalTxInputs.clear();
 
     CPrivateSendBase::SetNull();
 }
@@ -324,6 +316,17 @@ void CPrivateSendServer::CreateFinalTransaction(CConnman& connman)
     finalMutableTransaction = txNew;
     LogPrint("privatesend", "CPrivateSendServer::CreateFinalTransaction -- finalMutableTransaction=%s", txNew.ToString());
 
+    // index the final inputs once, signatures are verified against this layout
+    mapFinalTxInputs.clear();
+    std::map<COutPoint, CScript> mapPrevPubKeys;
+    BOOST_FOREACH(const CDarkSendEntry& entry, vecEntries)
+        BOOST_FOREACH(const CTxDSIn& txdsin, entry.vecTxDSIn)
+            mapPrevPubKeys[txdsin.prevout] = txdsin.prevPubKey;
+    for(unsigned int i = 0; i < finalMutableTransaction.vin.size(); i++) {
+        const COutPoint& prevout = finalMutableTransaction.vin[i].prevout;
+        mapFinalTxInputs[prevout] = std::make_pair(i, mapPrevPubKeys[prevout]);
+    }
+
     // request signatures from clients
     RelayFinalTransaction(finalMutableTransaction, connman);
     SetState(POOL_STATE_SIGNING);
@@ -333,10 +336,10 @@ void CPrivateSendServer::CommitFinalTransaction(CConnman& connman)
 {
     if(!fMasterNode) return; // check and relay final tx only on masternode
 
-    CTransaction finalTransaction = CTransaction(finalMutableTransaction);
-    uint256 hashTx = finalTransaction.GetHash();
+    CTransactionRef finalTransaction = MakeTransactionRef(finalMutableTransaction);
+    uint256 hashTx = finalTransaction->GetHash();
 
-    LogPrint("privatesend", "CPrivateSendServer::CommitFinalTransaction -- finalTransaction=%s", finalTransaction.ToString());
+    LogPrint("privatesend", "CPrivateSendServer::CommitFinalTransaction -- finalTransaction=%s", finalTransaction->ToString());
 
     {
         // See if the transaction is valid
@@ -531,46 +534,39 @@ void CPrivateSendServer::CheckForCompleteQueue(CConnman& connman)
     }
 }
 
-// Check to make sure a given input matches an input in the pool and its scriptSig is valid
-bool CPrivateSendServer::IsInputScriptSigValid(const CTxIn& txin)
+// Check to make sure given inputs match inputs in the pool and their scriptSigs are valid
+bool CPrivateSendServer::IsInputScriptSigsValid(const std::vector<CTxIn>& vecTxIn)
 {
-    CMutableTransaction txNew;
-    txNew.vin.clear();
-    txNew.vout.clear();
-
-    int i = 0;
-    int nTxInIndex = -1;
-    CScript sigPubKey = CScript();
-
-    BOOST_FOREACH(CDarkSendEntry& entry, vecEntries) {
-
-        for (const auto& txout : entry.vecTxOut)
-            txNew.vout.push_back(txout);
-
-        BOOST_FOREACH(const CTxDSIn& txdsin, entry.vecTxDSIn) {
-            txNew.vin.push_back(txdsin);
-
-            if(txdsin.prevout == txin.prevout) {
-                nTxInIndex = i;
-                sigPubKey = txdsin.prevPubKey;
-            }
-            i++;
+    // all scriptSigs of the batch go into a single copy of the final transaction
+    CMutableTransaction txNew(finalMutableTransaction);
+    std::vector<std::pair<unsigned int, CScript> > vecInputs;
+    vecInputs.reserve(vecTxIn.size());
+
+    BOOST_FOREACH(const CTxIn& txin, vecTxIn) {
+        std::map<COutPoint, std::pair<unsigned int, CScript> >::const_iterator it = mapFinalTxInputs.find(txin.prevout);
+        if(it == mapFinalTxInputs.end()) {
+            LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigsValid -- Failed to find matching input in pool, %s\n", txin.ToString());
+            return false;
         }
+        txNew.vin[it->second.first].scriptSig = txin.scriptSig;
+        vecInputs.push_back(it->second);
+        LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigsValid -- verifying scriptSig %s\n", ScriptToAsmStr(txin.scriptSig).substr(0,24));
     }
 
-    if(nTxInIndex >= 0) { //might have to do this one input at a time?
-        txNew.vin[nTxInIndex].scriptSig = txin.scriptSig;
-        LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigValid -- verifying scriptSig %s\n", ScriptToAsmStr(txin.scriptSig).substr(0,24));
-        if(!VerifyScript(txNew.vin[nTxInIndex].scriptSig, sigPubKey, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, MutableTransactionSignatureChecker(&txNew, nTxInIndex))) {
-            LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigValid -- VerifyScript() failed on input %d\n", nTxInIndex);
-            return false;
-        }
-    } else {
-        LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigValid -- Failed to find matching input in pool, %s\n", txin.ToString());
+    const CTransaction txToCheck(txNew);
+    std::vector<CScriptCheck> vChecks;
+    vChecks.reserve(vecInputs.size());
+    for(unsigned int i = 0; i < vecInputs.size(); i++) {
+        // store verified signatures in the cache, the final transaction is checked again on commit
+        vChecks.push_back(CScriptCheck(vecInputs[i].second, 0, txToCheck, vecInputs[i].first, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, true));
+    }
+
+    if(!RunScriptChecks(vChecks)) {
+        LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigsValid -- VerifyScript() failed\n");
         return false;
     }
 
-    LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigValid -- Successfully validated input and scriptSig\n");
+    LogPrint("privatesend", "CPrivateSendServer::IsInputScriptSigsValid -- Successfully validated %d inputs and scriptSigs\n", vecTxIn.size());
     return true;
 }
 
@@ -623,28 +619,49 @@ bool CPrivateSendServer::AddEntry(const CDarkSendEntry& entryNew, PoolMessage& n
     return true;
 }
 
-bool CPrivateSendServer::AddScriptSig(const CTxIn& txinNew)
+bool CPrivateSendServer::AddScriptSigs(const std::vector<CTxIn>& vecTxIn)
 {
-    LogPrint("privatesend", "CPrivateSendServer::AddScriptSig -- scriptSig=%s\n", ScriptToAsmStr(txinNew.scriptSig).substr(0,24));
+    for(unsigned int i = 0; i < vecTxIn.size(); i++) {
+        const CTxIn& txinNew = vecTxIn[i];
+        LogPrint("privatesend", "CPrivateSendServer::AddScriptSigs -- scriptSig=%s\n", ScriptToAsmStr(txinNew.scriptSig).substr(0,24));
 
-    BOOST_FOREACH(const CDarkSendEntry& entry, vecEntries) {
-        BOOST_FOREACH(const CTxDSIn& txdsin, entry.vecTxDSIn) {
-            if(txdsin.scriptSig == txinNew.scriptSig) {
-                LogPrint("privatesend", "CPrivateSendServer::AddScriptSig -- already exists\n");
+        BOOST_FOREACH(const CDarkSendEntry& entry, vecEntries) {
+            BOOST_FOREACH(const CTxDSIn& txdsin, entry.vecTxDSIn) {
+                if(txdsin.scriptSig == txinNew.scriptSig) {
+                    LogPrint("privatesend", "CPrivateSendServer::AddScriptSigs -- already exists\n");
+                    return false;
+                }
+            }
+        }
+        for(unsigned int j = 0; j < i; j++) {
+            if(vecTxIn[j].scriptSig == txinNew.scriptSig) {
+                LogPrint("privatesend", "CPrivateSendServer::AddScriptSigs -- duplicate in batch\n");
                 return false;
             }
         }
     }
 
-    if(!IsInputScriptSigValid(txinNew)) {
-        LogPrint("privatesend", "CPrivateSendServer::AddScriptSig -- Invalid scriptSig\n");
+    // verify the whole batch before touching the pool so a bad sig leaves no partial state
+    if(!IsInputScriptSigsValid(vecTxIn)) {
+        LogPrint("privatesend", "CPrivateSendServer::AddScriptSigs -- Invalid scriptSig\n");
         return false;
     }
 
+    BOOST_FOREACH(const CTxIn& txinNew, vecTxIn) {
+        if(!AddScriptSig(txinNew)) return false;
+    }
+
+    return true;
+}
+
+bool CPrivateSendServer::AddScriptSig(const CTxIn& txinNew)
+{
     LogPrint("privatesend", "CPrivateSendServer::AddScriptSig -- scriptSig=%s new\n", ScriptToAsmStr(txinNew.scriptSig).substr(0,24));
 
-    BOOST_FOREACH(CTxIn& txin, finalMutableTransaction.vin) {
-        if(txinNew.prevout == txin.prevout && txin.nSequence == txinNew.nSequence) {
+    std::map<COutPoint, std::pair<unsigned int, CScript> >::const_iterator it = mapFinalTxInputs.find(txinNew.prevout);
+    if(it != mapFinalTxInputs.end()) {
+        CTxIn& txin = finalMutableTransaction.vin[it->second.first];
+        if(txin.nSequence == txinNew.nSequence) {
             txin.scriptSig = txinNew.scriptSig;
             LogPrint("privatesend", "CPrivateSendServer::AddScriptSig -- adding to finalMutableTransaction, scriptSig=%s\n", ScriptToAsmStr(txinNew.scriptSig).substr(0,24));
         }
@@ -734,7 +751,7 @@ bool CPrivateSendServer::CreateNewSession(int nDenom, CTransaction txCollateral,
         LogPrint("privatesend", "CPrivateSendServer::CreateNewSession -- signing and relaying new queue: %s\n", dsq.ToString());
         dsq.Sign();
         dsq.Relay(connman);
-        vecDarksendQueue.push_back(dsq);
+        darksendQueues.Add(dsq);
     }
 
     vecSessionCollaterals.push_back(txCollateral);
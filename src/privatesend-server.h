@@ -22,10 +22,15 @@ private:
     // to behave honestly. If they don't it takes their money.
     std::vector<CTransaction> vecSessionCollaterals;
 
+    /// Inputs of finalMutableTransaction: position in vin and the script of the spent output
+    std::map<COutPoint, std::pair<unsigned int, CScript> > mapFinalTxInputs;
+
     bool fUnitTest;
 
     /// Add a clients entry to the pool
     bool AddEntry(const CDarkSendEntry& entryNew, PoolMessage& nMessageIDRet);
+    /// Verify a client's batch of signatures and add them to the final transaction
+    bool AddScriptSigs(const std::vector<CTxIn>& vecTxIn);
     /// Add signature to a txin
     bool AddScriptSig(const CTxIn& txin);
 
@@ -49,8 +54,8 @@ private:
 
     /// Check that all inputs are signed. (Are all inputs signed?)
     bool IsSignaturesComplete();
-    /// Check to make sure a given input matches an input in the pool and its scriptSig is valid
-    bool IsInputScriptSigValid(const CTxIn& txin);
+    /// Check to make sure given inputs match inputs in the pool and their scriptSigs are valid
+    bool IsInputScriptSigsValid(const std::vector<CTxIn>& vecTxIn);
     /// Are these outputs compatible with other client in the pool?
     bool IsOutputsCompatibleWithSessionDenom(const std::vector<CTxOut>& vecTxOut);
 
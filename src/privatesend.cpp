@@ -77,7 +77,7 @@ bool CDarksendBroadcastTx::Sign()
 {
     if(!fMasterNode) return false;
 
-    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = tx->GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
 
     if(!CMessageSigner::SignMessage(strMessage, vchSig, activeMasternode.keyMasternode)) {
         LogPrintf("CDarksendBroadcastTx::Sign -- SignMessage() failed\n");
@@ -89,7 +89,7 @@ bool CDarksendBroadcastTx::Sign()
 
 bool CDarksendBroadcastTx::CheckSignature(const CPubKey& pubKeyMasternode)
 {
-    std::string strMessage = tx.GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
+    std::string strMessage = tx->GetHash().ToString() + boost::lexical_cast<std::string>(sigTime);
     std::string strError = "";
 
     if(!CMessageSigner::VerifyMessage(pubKeyMasternode, vchSig, strMessage, strError)) {
@@ -106,6 +106,61 @@ bool CDarksendBroadcastTx::IsExpired(int nHeight)
     return (nConfirmedHeight != -1) && (nHeight - nConfirmedHeight > 24);
 }
 
+void CDarksendQueueIndex::Add(const CDarksendQueue& dsq)
+{
+    uint64_t nId = nNextId++;
+    mapQueues.insert(std::make_pair(nId, dsq));
+    mapQueuesByMasternode.insert(std::make_pair(dsq.vin.prevout, nId));
+    setQueuesByTime.insert(std::make_pair(dsq.nTime, nId));
+    if(!dsq.fTried) setUntried.insert(nId);
+}
+
+bool CDarksendQueueIndex::Has(const CDarksendQueue& dsq) const
+{
+    auto range = mapQueuesByMasternode.equal_range(dsq.vin.prevout);
+    for(auto it = range.first; it != range.second; ++it) {
+        if(mapQueues.at(it->second) == dsq) return true;
+    }
+    return false;
+}
+
+bool CDarksendQueueIndex::PopUntried(CDarksendQueue& dsqRet)
+{
+    if(setUntried.empty()) return false;
+    std::set<uint64_t>::iterator it = setUntried.begin();
+    CDarksendQueue& dsq = mapQueues.at(*it);
+    dsq.fTried = true;
+    dsqRet = dsq;
+    setUntried.erase(it);
+    return true;
+}
+
+void CDarksendQueueIndex::RemoveExpired()
+{
+    // queues are ordered by nTime so we can stop at the first one that is still valid
+    while(!setQueuesByTime.empty()) {
+        std::map<uint64_t, CDarksendQueue>::iterator it = mapQueues.find(setQueuesByTime.begin()->second);
+        if(!it->second.IsExpired()) break;
+        LogPrint("privatesend", "CDarksendQueueIndex::%s -- Removing expired queue (%s)\n", __func__, it->second.ToString());
+        Erase(it);
+    }
+}
+
+void CDarksendQueueIndex::Erase(std::map<uint64_t, CDarksendQueue>::iterator it)
+{
+    uint64_t nId = it->first;
+    auto range = mapQueuesByMasternode.equal_range(it->second.vin.prevout);
+    for(auto itMn = range.first; itMn != range.second; ++itMn) {
+        if(itMn->second == nId) {
+            mapQueuesByMasternode.erase(itMn);
+            break;
+        }
+    }
+    setQueuesByTime.erase(std::make_pair(it->second.nTime, nId));
+    setUntried.erase(nId);
+    mapQueues.erase(it);
+}
+
 void CPrivateSendBase::SetNull()
 {
     // Both sides
@@ -124,13 +179,7 @@ void CPrivateSendBase::CheckQueue()
     if(!lockDS) return; // it's ok to fail here, we run this quite frequently
 
     // check mixing queue objects for timeouts
-    std::vector<CDarksendQueue>::iterator it = vecDarksendQueue.begin();
-    while(it != vecDarksendQueue.end()) {
-        if((*it).IsExpired()) {
-            LogPrint("privatesend", "CPrivateSendBase::%s -- Removing expired queue (%s)\n", __func__, (*it).ToString());
-            it = vecDarksendQueue.erase(it);
-        } else ++it;
-    }
+    darksendQueues.RemoveExpired();
 }
 
 std::string CPrivateSendBase::GetStateString() const
@@ -149,6 +198,7 @@ std::string CPrivateSendBase::GetStateString() const
 // Definitions for static data members
 std::vector<CAmount> CPrivateSend::vecStandardDenominations;
 std::map<uint256, CDarksendBroadcastTx> CPrivateSend::mapDSTX;
+std::map<int, std::set<uint256> > CPrivateSend::mapDSTXByHeight;
 CCriticalSection CPrivateSend::cs_mapdstx;
 
 void CPrivateSend::InitStandardDenominations()
@@ -379,7 +429,7 @@ std::string CPrivateSend::GetMessageByID(PoolMessage nMessageID)
 void CPrivateSend::AddDSTX(const CDarksendBroadcastTx& dstx)
 {
     LOCK(cs_mapdstx);
-    mapDSTX.insert(std::make_pair(dstx.tx.GetHash(), dstx));
+    mapDSTX.insert(std::make_pair(dstx.tx->GetHash(), dstx));
 }
 
 CDarksendBroadcastTx CPrivateSend::GetDSTX(const uint256& hash)
@@ -392,13 +442,12 @@ CDarksendBroadcastTx CPrivateSend::GetDSTX(const uint256& hash)
 void CPrivateSend::CheckDSTXes(int nHeight)
 {
     LOCK(cs_mapdstx);
-    std::map<uint256, CDarksendBroadcastTx>::iterator it = mapDSTX.begin();
-    while(it != mapDSTX.end()) {
-        if (it->second.IsExpired(nHeight)) {
-            mapDSTX.erase(it++);
-        } else {
-            ++it;
-        }
+    // only buckets confirmed more than 24 blocks ago can hold expired DSTXes
+    std::map<int, std::set<uint256> >::iterator it = mapDSTXByHeight.begin();
+    while(it != mapDSTXByHeight.end() && nHeight - it->first > 24) {
+        BOOST_FOREACH(const uint256& txHash, it->second)
+            mapDSTX.erase(txHash);
+        mapDSTXByHeight.erase(it++);
     }
     LogPrint("privatesend", "CPrivateSend::CheckDSTXes -- mapDSTX.size()=%llu\n", mapDSTX.size());
 }
@@ -431,7 +480,18 @@ void CPrivateSend::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
         }
         pblockindex = mi->second;
     }
-    mapDSTX[txHash].SetConfirmedHeight(pblockindex ? pblockindex->nHeight : -1);
+    CDarksendBroadcastTx& dstx = mapDSTX[txHash];
+    int nConfirmedHeightOld = dstx.GetConfirmedHeight();
+    int nConfirmedHeightNew = pblockindex ? pblockindex->nHeight : -1;
+    if(nConfirmedHeightOld != -1) {
+        std::map<int, std::set<uint256> >::iterator it = mapDSTXByHeight.find(nConfirmedHeightOld);
+        if(it != mapDSTXByHeight.end()) {
+            it->second.erase(txHash);
+            if(it->second.empty()) mapDSTXByHeight.erase(it);
+        }
+    }
+    if(nConfirmedHeightNew != -1) mapDSTXByHeight[nConfirmedHeightNew].insert(txHash);
+    dstx.SetConfirmedHeight(nConfirmedHeightNew);
     LogPrint("privatesend", "CPrivateSendClient::SyncTransaction -- txid=%s\n", txHash.ToString());
 }
 
@@ -216,20 +216,20 @@ private:
     int nConfirmedHeight;
 
 public:
-    CTransaction tx;
+    CTransactionRef tx;
     CTxIn vin;
     std::vector<unsigned char> vchSig;
     int64_t sigTime;
 
     CDarksendBroadcastTx() :
         nConfirmedHeight(-1),
-        tx(),
+        tx(MakeTransactionRef()),
         vin(),
         vchSig(),
         sigTime(0)
         {}
 
-    CDarksendBroadcastTx(CTransaction tx, COutPoint outpoint, int64_t sigTime) :
+    CDarksendBroadcastTx(const CTransactionRef& tx, COutPoint outpoint, int64_t sigTime) :
         nConfirmedHeight(-1),
         tx(tx),
         vin(CTxIn(outpoint)),
@@ -249,7 +249,7 @@ public:
 
     friend bool operator==(const CDarksendBroadcastTx& a, const CDarksendBroadcastTx& b)
     {
-        return a.tx == b.tx;
+        return *a.tx == *b.tx;
     }
     friend bool operator!=(const CDarksendBroadcastTx& a, const CDarksendBroadcastTx& b)
     {
@@ -264,9 +264,42 @@ public:
     bool CheckSignature(const CPubKey& pubKeyMasternode);
 
     void SetConfirmedHeight(int nConfirmedHeightIn) { nConfirmedHeight = nConfirmedHeightIn; }
+    int GetConfirmedHeight() const { return nConfirmedHeight; }
     bool IsExpired(int nHeight);
 };
 
+/** Mixing queues announced on the network, indexed by masternode and by announce time
+ *  so that duplicate checks, joins and expiry don't have to walk every queue.
+ */
+class CDarksendQueueIndex
+{
+private:
+    // queues by insertion id, ids grow monotonically so this is also arrival order
+    std::map<uint64_t, CDarksendQueue> mapQueues;
+    std::multimap<COutPoint, uint64_t> mapQueuesByMasternode;
+    // (nTime, id), the front of the set is the next queue to expire
+    std::set<std::pair<int64_t, uint64_t> > setQueuesByTime;
+    // queues the client hasn't tried to join yet
+    std::set<uint64_t> setUntried;
+    uint64_t nNextId;
+
+    void Erase(std::map<uint64_t, CDarksendQueue>::iterator it);
+
+public:
+    CDarksendQueueIndex() : nNextId(0) {}
+
+    void Add(const CDarksendQueue& dsq);
+    /// Have we seen exactly this dsq already?
+    bool Has(const CDarksendQueue& dsq) const;
+    /// Is there a queue from this masternode already?
+    bool HasMasternode(const COutPoint& outpoint) const { return mapQueuesByMasternode.count(outpoint); }
+    /// Take the oldest queue we haven't tried yet and mark it as tried
+    bool PopUntried(CDarksendQueue& dsqRet);
+    void RemoveExpired();
+
+    size_t size() const { return mapQueues.size(); }
+};
+
 // base class
 class CPrivateSendBase
 {
@@ -274,7 +307,7 @@ protected:
     mutable CCriticalSection cs_darksend;
 
     // The current mixing sessions in progress on the network
-    std::vector<CDarksendQueue> vecDarksendQueue;
+    CDarksendQueueIndex darksendQueues;
 
     std::vector<CDarkSendEntry> vecEntries; // Masternode/clients entries
 
@@ -293,7 +326,7 @@ public:
 
     CPrivateSendBase() { SetNull(); }
 
-    int GetQueueSize() const { return vecDarksendQueue.size(); }
+    int GetQueueSize() const { return darksendQueues.size(); }
     int GetState() const { return nState; }
     std::string GetStateString() const;
 
@@ -315,6 +348,8 @@ private:
     // static members
     static std::vector<CAmount> vecStandardDenominations;
     static std::map<uint256, CDarksendBroadcastTx> mapDSTX;
+    // confirmed DSTXes bucketed by confirmation height for expiry
+    static std::map<int, std::set<uint256> > mapDSTXByHeight;
 
     static CCriticalSection cs_mapdstx;
 
@@ -12,14 +12,19 @@
 
 #include "netaddress.h"
 #include "serialize.h"
+#include "support/allocators/zeroafterfree.h"
 #include "uint256.h"
 #include "version.h"
 
+#include <memory>
 #include <stdint.h>
 #include <string>
 
 #define MESSAGE_START_SIZE 4
 
+/** A complete serialized network message, header and payload, shared by the send queues of all peers it is pushed to */
+typedef std::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
 /** Message header.
  * (4) message start.
  * (12) command.
@@ -218,6 +223,32 @@ extern const char *REJECT;
  * @see https://bitcoin.org/en/developer-reference#sendheaders
  */
 extern const char *SENDHEADERS;
+/**
+ * Contains a 1-byte bool and 8-byte LE version number.
+ * Indicates that a node is willing to provide blocks via "cmpctblock" messages.
+ * May indicate that a node prefers to receive new block announcements via a
+ * "cmpctblock" message rather than an "inv", depending on message contents.
+ * @since protocol version 70209 as described by BIP 152
+ */
+extern const char *SENDCMPCT;
+/**
+ * Contains a CBlockHeaderAndShortTxIDs object - providing a header and
+ * list of "short txids".
+ * @since protocol version 70209 as described by BIP 152
+ */
+extern const char *CMPCTBLOCK;
+/**
+ * Contains a BlockTransactionsRequest
+ * Peer should respond with "blocktxn" message.
+ * @since protocol version 70209 as described by BIP 152
+ */
+extern const char *GETBLOCKTXN;
+/**
+ * Contains a BlockTransactions.
+ * Sent in response to a "getblocktxn" message.
+ * @since protocol version 70209 as described by BIP 152
+ */
+extern const char *BLOCKTXN;
 
 // Digitalcoin message types
 // NOTE: do NOT declare non-implmented here, we don't want them to be exposed to the outside
@@ -328,6 +359,7 @@ public:
     }
 
     friend bool operator<(const CInv& a, const CInv& b);
+    friend bool operator==(const CInv& a, const CInv& b);
 
     bool IsKnownType() const;
     const char* GetCommand() const;
@@ -363,6 +395,9 @@ enum {
     MSG_GOVERNANCE_OBJECT,
     MSG_GOVERNANCE_OBJECT_VOTE,
     MSG_MASTERNODE_VERIFY,
+    // Nodes may always request a MSG_CMPCT_BLOCK in a getdata, however,
+    // MSG_CMPCT_BLOCK should not appear in any invs except as a part of getdata.
+    MSG_CMPCT_BLOCK, //!< Defined in BIP152
 };
 
 #endif // BITCOIN_PROTOCOL_H
@@ -0,0 +1,178 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+
+#include "core_memusage.h"
+#include "hash.h"
+#include "memusage.h"
+#include "random.h"
+#include "utiltime.h"
+
+SaltedInvHasher::SaltedInvHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t SaltedInvHasher::operator()(const CInv& inv) const
+{
+    return SipHashUint256Extra(k0, k1, inv.hash, inv.type);
+}
+
+CRelayCache::CRelayCache(size_t nMaxUsageIn) :
+    nUsage(0),
+    nMaxUsage(nMaxUsageIn),
+    nEvicted(0)
+{}
+
+void CRelayCache::Erase(list_t::iterator it)
+{
+    nUsage -= it->nUsage;
+    mapExpire.erase(it->itExpire);
+    mapEntries.erase(it->inv);
+    listEntries.erase(it);
+}
+
+void CRelayCache::SetExpiry(CRelayEntry& entry, int64_t nNow)
+{
+    entry.itExpire = mapExpire.insert(std::make_pair(nNow + RELAY_CACHE_EXPIRY, entry.inv));
+}
+
+void CRelayCache::Trim(int64_t nNow)
+{
+    // Expired entries are only requested by misbehaving peers, drop them
+    // first. Recently used ones can sit anywhere in listEntries.
+    while (!mapExpire.empty() && mapExpire.begin()->first < nNow)
+        Erase(mapEntries.at(mapExpire.begin()->second));
+    while (!listEntries.empty() && nUsage > nMaxUsage) {
+        Erase(--listEntries.end());
+        nEvicted++;
+    }
+}
+
+void CRelayCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim(GetTime());
+}
+
+size_t CRelayCache::EntryUsage()
+{
+    // The list node, the hash table node and the expiry node
+    return memusage::MallocUsage(sizeof(CRelayEntry) + 2 * sizeof(void*)) +
+           memusage::MallocUsage(sizeof(map_t::value_type) + sizeof(void*)) +
+           memusage::MallocUsage(sizeof(memusage::stl_tree_node<expiry_t::value_type>));
+}
+
+size_t CRelayCache::MessageUsage(const CSerializedNetMsg& msg)
+{
+    // The buffer plus the vector sharing a block with its reference counts
+    return memusage::MallocUsage(msg->capacity()) + memusage::MallocUsage(sizeof(CSerializeData) + 2 * sizeof(int));
+}
+
+CRelayCache::list_t::iterator CRelayCache::Lookup(const CInv& inv, int64_t nNow)
+{
+    map_t::iterator mi = mapEntries.find(inv);
+    if (mi == mapEntries.end())
+        return listEntries.end();
+    if (mi->second->itExpire->first < nNow) {
+        Erase(mi->second);
+        return listEntries.end();
+    }
+    listEntries.splice(listEntries.begin(), listEntries, mi->second);
+    return listEntries.begin();
+}
+
+void CRelayCache::Insert(const CInv& inv, const CTransactionRef& tx, int64_t nNow)
+{
+    LOCK(cs);
+    map_t::iterator mi = mapEntries.find(inv);
+    if (mi != mapEntries.end()) {
+        // Announced again, keep it around for another expiry period
+        CRelayEntry& entry = *mi->second;
+        mapExpire.erase(entry.itExpire);
+        SetExpiry(entry, nNow);
+        if (!entry.tx) {
+            size_t nTxUsage = RecursiveDynamicUsage(tx);
+            entry.tx = tx;
+            entry.nUsage += nTxUsage;
+            nUsage += nTxUsage;
+        }
+        listEntries.splice(listEntries.begin(), listEntries, mi->second);
+        Trim(nNow);
+        return;
+    }
+
+    size_t nEntryUsage = RecursiveDynamicUsage(tx) + EntryUsage();
+    listEntries.push_front(CRelayEntry{inv, tx, CSerializedNetMsg(), nEntryUsage, expiry_t::iterator()});
+    SetExpiry(listEntries.front(), nNow);
+    mapEntries.emplace(inv, listEntries.begin());
+    nUsage += nEntryUsage;
+    Trim(nNow);
+}
+
+CTransactionRef CRelayCache::Find(const CInv& inv, int64_t nNow)
+{
+    LOCK(cs);
+    list_t::iterator it = Lookup(inv, nNow);
+    if (it == listEntries.end())
+        return CTransactionRef();
+    return it->tx;
+}
+
+void CRelayCache::InsertMessage(const CInv& inv, const CSerializedNetMsg& msg, int64_t nNow)
+{
+    LOCK(cs);
+    list_t::iterator it = Lookup(inv, nNow);
+    if (it == listEntries.end())
+        return;
+    if (it->msg) {
+        nUsage -= MessageUsage(it->msg);
+        it->nUsage -= MessageUsage(it->msg);
+    }
+    it->msg = msg;
+    it->nUsage += MessageUsage(msg);
+    nUsage += MessageUsage(msg);
+    Trim(nNow);
+}
+
+CSerializedNetMsg CRelayCache::FindMessage(const CInv& inv, int64_t nNow)
+{
+    LOCK(cs);
+    list_t::iterator it = Lookup(inv, nNow);
+    if (it == listEntries.end())
+        return CSerializedNetMsg();
+    return it->msg;
+}
+
+void CRelayCache::Clear()
+{
+    LOCK(cs);
+    mapEntries.clear();
+    mapExpire.clear();
+    listEntries.clear();
+    nUsage = 0;
+}
+
+size_t CRelayCache::Size() const
+{
+    LOCK(cs);
+    return listEntries.size();
+}
+
+size_t CRelayCache::Usage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
+
+size_t CRelayCache::MaxUsage() const
+{
+    LOCK(cs);
+    return nMaxUsage;
+}
+
+uint64_t CRelayCache::Evicted() const
+{
+    LOCK(cs);
+    return nEvicted;
+}
@@ -0,0 +1,101 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef RELAYCACHE_H
+#define RELAYCACHE_H
+
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <unordered_map>
+
+/** Default for -maxrelaycache, maximum megabytes of recently relayed inventory kept for getdata */
+static const unsigned int DEFAULT_MAX_RELAY_CACHE = 20;
+/** Seconds a relayed transaction may be requested from the relay cache */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
+
+class SaltedInvHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedInvHasher();
+
+    size_t operator()(const CInv& inv) const;
+};
+
+/**
+ * Inventory we recently relayed to our peers. Relayed transactions are kept so
+ * that peers can fetch them with getdata even after they left the mempool.
+ *
+ * Entries reference the canonical transaction objects shared with the mempool
+ * and InstantSend, and the complete network message once an inventory item has
+ * been served, so that further peers asking for it share the same serialized
+ * bytes. Whether any other item may still be served is up to its owner, the
+ * cache only saves serializing it again. Entries are only created when we relay
+ * an item, so that answering requests for anything else, like the governance
+ * sync, doesn't use up the memory budget. The cache is bounded by the memory those objects would keep alive on
+ * their own and evicts the least recently used entries first. Expired entries
+ * are dropped before that, in the order they expire.
+ */
+class CRelayCache
+{
+private:
+    typedef std::multimap<int64_t, CInv> expiry_t;
+
+    struct CRelayEntry {
+        CInv inv;
+        CTransactionRef tx;
+        CSerializedNetMsg msg;
+        size_t nUsage;
+        expiry_t::iterator itExpire;
+    };
+
+    typedef std::list<CRelayEntry> list_t;
+    typedef std::unordered_map<CInv, list_t::iterator, SaltedInvHasher> map_t;
+
+    mutable CCriticalSection cs;
+    //! Most recently used entry first
+    list_t listEntries;
+    map_t mapEntries;
+    //! All entries by expiry time, independent of how recently they were used
+    expiry_t mapExpire;
+    size_t nUsage;
+    size_t nMaxUsage;
+    uint64_t nEvicted;
+
+    static size_t EntryUsage();
+    static size_t MessageUsage(const CSerializedNetMsg& msg);
+
+    void Erase(list_t::iterator it);
+    void SetExpiry(CRelayEntry& entry, int64_t nNow);
+    list_t::iterator Lookup(const CInv& inv, int64_t nNow);
+    void Trim(int64_t nNow);
+
+public:
+    CRelayCache(size_t nMaxUsageIn = DEFAULT_MAX_RELAY_CACHE * 1000000);
+
+    void SetMaxUsage(size_t nMaxUsageIn);
+    //! Remember that inv was relayed, tx is the shared transaction or NULL for other inventory
+    void Insert(const CInv& inv, const CTransactionRef& tx, int64_t nNow);
+    //! Returns the cached transaction, or NULL when it is unknown or expired
+    CTransactionRef Find(const CInv& inv, int64_t nNow);
+    //! Keep the serialized message for inv until the entry expires, if inv was relayed
+    void InsertMessage(const CInv& inv, const CSerializedNetMsg& msg, int64_t nNow);
+    //! Returns the cached message, or NULL when it is unknown or expired
+    CSerializedNetMsg FindMessage(const CInv& inv, int64_t nNow);
+    void Clear();
+
+    size_t Size() const;
+    size_t Usage() const;
+    size_t MaxUsage() const;
+    uint64_t Evicted() const;
+};
+
+#endif // RELAYCACHE_H
@@ -212,11 +212,7 @@ UniValue masternode(const UniValue& params, bool fHelp)
         int nCount;
         int nHeight;
         masternode_info_t mnInfo;
-        CBlockIndex* pindex = NULL;
-        {
-            LOCK(cs_main);
-            pindex = chainActive.Tip();
-        }
+        CBlockIndex* pindex = GetChainView().Tip();
         nHeight = pindex->nHeight + (strCommand == "current" ? 1 : 10);
         mnodeman.UpdateLastPaid(pindex);
 
@@ -404,14 +400,9 @@ UniValue masternode(const UniValue& params, bool fHelp)
 
     if (strCommand == "winners")
     {
-        int nHeight;
-        {
-            LOCK(cs_main);
-            CBlockIndex* pindex = chainActive.Tip();
-            if(!pindex) return NullUniValue;
-
-            nHeight = pindex->nHeight;
-        }
+        CBlockIndex* pindex = GetChainView().Tip();
+        if(!pindex) return NullUniValue;
+        int nHeight = pindex->nHeight;
 
         int nLast = 10;
         std::string strFilter = "";
@@ -484,11 +475,7 @@ UniValue masternodelist(const UniValue& params, bool fHelp)
     }
 
     if (strMode == "full" || strMode == "lastpaidtime" || strMode == "lastpaidblock") {
-        CBlockIndex* pindex = NULL;
-        {
-            LOCK(cs_main);
-            pindex = chainActive.Tip();
-        }
+        CBlockIndex* pindex = GetChainView().Tip();
         mnodeman.UpdateLastPaid(pindex);
     }
 
@@ -90,6 +90,9 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"pingtime\": n,             (numeric) ping time (if available)\n"
             "    \"minping\": n,              (numeric) minimum observed ping time (if any at all)\n"
             "    \"pingwait\": n,             (numeric) ping wait (if non-zero)\n"
+            "    \"invqueue\": n,             (numeric) Transactions waiting for the next inventory batch to this peer\n"
+            "    \"invlatency\": n,           (numeric) Average time in seconds transactions waited before being announced\n"
+            "    \"invdropped\": n,           (numeric) Transaction announcements dropped because the queue was full\n"
             "    \"version\": v,              (numeric) The peer version, such as 7001\n"
             "    \"subver\": \"/Digitalcoin Core:x.x.x/\",  (string) The string version\n"
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
@@ -147,6 +150,9 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("minping", stats.dMinPing));
         if (stats.dPingWait > 0.0)
             obj.push_back(Pair("pingwait", stats.dPingWait));
+        obj.push_back(Pair("invqueue", (uint64_t)stats.nInvQueueSize));
+        obj.push_back(Pair("invlatency", stats.dInvLatency));
+        obj.push_back(Pair("invdropped", stats.nInvDropped));
         obj.push_back(Pair("version", stats.nVersion));
         // Use the sanitized form of subver here, to avoid tricksy remote peers from
         // corrupting or modifiying the JSON output by putting special characters in
@@ -415,6 +421,12 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  ,...\n"
             "  ],\n"
             "  \"relayfee\": x.xxxxxxxx,                (numeric) minimum relay fee for non-free transactions in " + CURRENCY_UNIT + "/kB\n"
+            "  \"relaycache\": {                        (object) recently relayed transactions kept for peers\n"
+            "    \"size\": xxxxx,                       (numeric) number of cached transactions\n"
+            "    \"usage\": xxxxx,                      (numeric) memory usage of the cache in bytes\n"
+            "    \"maxusage\": xxxxx,                   (numeric) memory limit of the cache in bytes (-maxrelaycache)\n"
+            "    \"evicted\": xxxxx                     (numeric) entries evicted to stay below the limit\n"
+            "  },\n"
             "  \"localaddresses\": [                    (array) list of local addresses\n"
             "  {\n"
             "    \"address\": \"xxxx\",                 (string) network address\n"
@@ -445,6 +457,12 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
     }
     obj.push_back(Pair("networks",      GetNetworksInfo()));
     obj.push_back(Pair("relayfee",      ValueFromAmount(::minRelayTxFee.GetFeePerK())));
+    UniValue relaycache(UniValue::VOBJ);
+    relaycache.push_back(Pair("size",     (uint64_t)relayCache.Size()));
+    relaycache.push_back(Pair("usage",    (uint64_t)relayCache.Usage()));
+    relaycache.push_back(Pair("maxusage", (uint64_t)relayCache.MaxUsage()));
+    relaycache.push_back(Pair("evicted",  relayCache.Evicted()));
+    obj.push_back(Pair("relaycache",    relaycache));
     UniValue localAddresses(UniValue::VARR);
     {
         LOCK(cs_mapLocalHost);
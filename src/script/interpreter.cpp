@@ -11,6 +11,7 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
 using namespace std;
@@ -1104,9 +1105,73 @@ public:
     }
 };
 
+/** Double SHA256 writer that can start from a saved midstate */
+class CMidstateHashWriter
+{
+private:
+    CSHA256 ctx;
+
+public:
+    int nType;
+    int nVersion;
+
+    CMidstateHashWriter(const CSHA256& ctxIn, int nTypeIn, int nVersionIn) : ctx(ctxIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    CMidstateHashWriter& write(const char *pch, size_t size) {
+        ctx.Write((const unsigned char*)pch, size);
+        return (*this);
+    }
+
+    template<typename T>
+    CMidstateHashWriter& operator<<(const T& obj) {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+
+    uint256 GetHash() {
+        unsigned char buf[CSHA256::OUTPUT_SIZE];
+        ctx.Finalize(buf);
+        uint256 result;
+        CSHA256().Write(buf, CSHA256::OUTPUT_SIZE).Finalize(result.begin());
+        return result;
+    }
+};
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    // Same layout as CTransactionSignatureSerializer for SIGHASH_ALL, with
+    // every input blanked.
+    CDataStream ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, 1);
+    anyoneCanPayMidstate.Write((const unsigned char*)&ss[0], ss.size());
+
+    ss.clear();
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+    CSHA256 ctx;
+    ctx.Write((const unsigned char*)&ss[0], ss.size());
+
+    vInputMidstates.reserve(txTo.vin.size());
+    vBlankedInputOffsets.reserve(txTo.vin.size() + 1);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        vInputMidstates.push_back(ctx);
+        vBlankedInputOffsets.push_back(vchBlankedInputs.size());
+        ss.clear();
+        ss << txTo.vin[i].prevout << CScriptBase() << txTo.vin[i].nSequence;
+        ctx.Write((const unsigned char*)&ss[0], ss.size());
+        vchBlankedInputs.insert(vchBlankedInputs.end(), ss.begin(), ss.end());
+    }
+    vBlankedInputOffsets.push_back(vchBlankedInputs.size());
+
+    ss.clear();
+    ss << txTo.vout << txTo.nLockTime;
+    vchOutputs.assign(ss.begin(), ss.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* cache)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1125,6 +1190,22 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    // For SIGHASH_ALL everything but the input being signed is the same for all
+    // inputs, so resume from the precomputed state and only serialize that input.
+    // With SIGHASH_ANYONECANPAY (as used by PrivateSend) that input is the only one.
+    if (cache && cache->vInputMidstates.size() == txTo.vin.size() &&
+        (nHashType & 0x1f) != SIGHASH_SINGLE && (nHashType & 0x1f) != SIGHASH_NONE) {
+        bool fAnyoneCanPay = nHashType & SIGHASH_ANYONECANPAY;
+        CMidstateHashWriter ss(fAnyoneCanPay ? cache->anyoneCanPayMidstate : cache->vInputMidstates[nIn], SER_GETHASH, 0);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        size_t nOffset = cache->vBlankedInputOffsets[nIn + 1];
+        if (!fAnyoneCanPay && nOffset < cache->vchBlankedInputs.size())
+            ss.write((const char*)&cache->vchBlankedInputs[nOffset], cache->vchBlankedInputs.size() - nOffset);
+        ss.write((const char*)&cache->vchOutputs[0], cache->vchOutputs.size());
+        ss << nHashType;
+        return ss.GetHash();
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1149,7 +1230,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
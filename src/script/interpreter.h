@@ -7,6 +7,7 @@
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
 #include "script_error.h"
+#include "crypto/sha256.h"
 #include "primitives/transaction.h"
 
 #include <vector>
@@ -90,7 +91,28 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * Serialized parts of a transaction shared by the signature hashes of all its
+ * inputs. Without it every input of a SIGHASH_ALL signed transaction
+ * re-serializes and re-hashes the whole transaction from scratch.
+ */
+struct PrecomputedTransactionData
+{
+    //! hash state after nVersion, the input count and the blanked inputs before input i
+    std::vector<CSHA256> vInputMidstates;
+    //! hash state after nVersion and the single input count of SIGHASH_ANYONECANPAY
+    CSHA256 anyoneCanPayMidstate;
+    //! inputs with empty scriptSigs serialized back to back, with the start of each one
+    std::vector<unsigned char> vchBlankedInputs;
+    std::vector<size_t> vBlankedInputOffsets;
+    //! output count, outputs and nLockTime
+    std::vector<unsigned char> vchOutputs;
+
+    PrecomputedTransactionData() {}
+    PrecomputedTransactionData(const CTransaction& tx);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* cache = NULL);
 
 class BaseSignatureChecker
 {
@@ -118,12 +140,14 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn), txdata(NULL) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData& txdataIn) : txTo(txToIn), nIn(nInIn), txdata(&txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
@@ -11,6 +11,8 @@
 #include "uint256.h"
 #include "util.h"
 
+#include <atomic>
+
 #include <boost/thread.hpp>
 #include <boost/unordered_set.hpp>
 
@@ -87,6 +89,13 @@ public:
     }
 };
 
+std::atomic<uint64_t> nSignatureCacheHits(0);
+
+}
+
+uint64_t GetSignatureCacheHits()
+{
+    return nSignatureCacheHits;
 }
 
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
@@ -97,6 +106,7 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
     if (signatureCache.Get(entry)) {
+        nSignatureCacheHits++;
         if (!store) {
             signatureCache.Erase(entry);
         }
@@ -121,6 +121,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -308,6 +309,12 @@ public:
         clear();
     }
 
+    /** Exchange the underlying storage with data without copying, rewinding the read position */
+    void SwapData(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
+
     /**
      * XOR the contents of this stream with a certain key.
      *
@@ -558,6 +565,17 @@ public:
         return (*this);
     }
 
+    // skip a number of bytes
+    CBufferedFile& ignore(size_t nSize) {
+        char data[4096];
+        while (nSize > 0) {
+            size_t nNow = std::min<size_t>(nSize, sizeof(data));
+            read(data, nNow);
+            nSize -= nNow;
+        }
+        return (*this);
+    }
+
     // return the current reading position
     uint64_t GetPos() {
         return nReadPos;
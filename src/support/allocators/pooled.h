@@ -0,0 +1,167 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+#define BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
+
+#include "memusage.h"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+/**
+ * Keeps the single object allocations of node based containers (the nodes of a
+ * multi_index_container, std::map or std::unordered_map) around after they are
+ * freed and hands them out again, instead of going through the system allocator
+ * for every insert and erase. Up to nMaxFree chunks of every size are kept.
+ *
+ * Not thread safe: only share a pool between containers guarded by the same lock.
+ */
+class CNodePool
+{
+private:
+    struct FreeChunk {
+        FreeChunk* next;
+    };
+
+    struct FreeList {
+        size_t nSize;
+        size_t nCount;
+        FreeChunk* head;
+    };
+
+    //! Node based containers only ever ask for a handful of distinct sizes
+    std::vector<FreeList> vFreeLists;
+    size_t nMaxFree;
+
+    FreeList& GetFreeList(size_t nSize)
+    {
+        for (size_t i = 0; i < vFreeLists.size(); i++) {
+            if (vFreeLists[i].nSize == nSize)
+                return vFreeLists[i];
+        }
+        vFreeLists.push_back(FreeList{nSize, 0, NULL});
+        return vFreeLists.back();
+    }
+
+public:
+    explicit CNodePool(size_t nMaxFreeIn) : nMaxFree(nMaxFreeIn) {}
+    ~CNodePool() { Clear(); }
+
+    CNodePool(const CNodePool&) = delete;
+    CNodePool& operator=(const CNodePool&) = delete;
+
+    void* Allocate(size_t nSize)
+    {
+        FreeList& list = GetFreeList(nSize);
+        if (list.head == NULL)
+            return ::operator new(std::max(nSize, sizeof(FreeChunk)));
+        FreeChunk* chunk = list.head;
+        list.head = chunk->next;
+        list.nCount--;
+        return chunk;
+    }
+
+    void Deallocate(void* p, size_t nSize)
+    {
+        FreeList& list = GetFreeList(nSize);
+        if (list.nCount >= nMaxFree) {
+            ::operator delete(p);
+            return;
+        }
+        FreeChunk* chunk = static_cast<FreeChunk*>(p);
+        chunk->next = list.head;
+        list.head = chunk;
+        list.nCount++;
+    }
+
+    //! Return all chunks waiting for reuse to the system allocator
+    void Clear()
+    {
+        for (size_t i = 0; i < vFreeLists.size(); i++) {
+            FreeList& list = vFreeLists[i];
+            while (list.head != NULL) {
+                FreeChunk* chunk = list.head;
+                list.head = chunk->next;
+                ::operator delete(chunk);
+            }
+            list.nCount = 0;
+        }
+    }
+
+    //! Memory held by chunks waiting for reuse
+    size_t DynamicMemoryUsage() const
+    {
+        size_t nUsage = memusage::DynamicUsage(vFreeLists);
+        for (size_t i = 0; i < vFreeLists.size(); i++)
+            nUsage += memusage::MallocUsage(std::max(vFreeLists[i].nSize, sizeof(FreeChunk))) * vFreeLists[i].nCount;
+        return nUsage;
+    }
+};
+
+/** Allocator that takes single objects from a CNodePool, and anything else (such as hash table buckets) from the heap */
+template <typename T>
+struct pooled_allocator : public std::allocator<T> {
+    typedef std::allocator<T> base;
+    typedef typename base::size_type size_type;
+    typedef typename base::difference_type difference_type;
+    typedef typename base::pointer pointer;
+    typedef typename base::const_pointer const_pointer;
+    typedef typename base::reference reference;
+    typedef typename base::const_reference const_reference;
+    typedef typename base::value_type value_type;
+    // Allocators sharing a pool are interchangeable, others are not
+    typedef std::false_type is_always_equal;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    CNodePool* pool;
+
+    pooled_allocator() throw() : pool(NULL) {}
+    explicit pooled_allocator(CNodePool* poolIn) throw() : pool(poolIn) {}
+    pooled_allocator(const pooled_allocator& a) throw() : base(a), pool(a.pool) {}
+    template <typename U>
+    pooled_allocator(const pooled_allocator<U>& a) throw() : base(a), pool(a.pool)
+    {
+    }
+    ~pooled_allocator() throw() {}
+    template <typename _Other>
+    struct rebind {
+        typedef pooled_allocator<_Other> other;
+    };
+
+    T* allocate(std::size_t n, const void* hint = 0)
+    {
+        if (pool == NULL || n != 1)
+            return base::allocate(n);
+        return static_cast<T*>(pool->Allocate(sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if (pool == NULL || n != 1) {
+            base::deallocate(p, n);
+            return;
+        }
+        pool->Deallocate(p, sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pooled_allocator<T>& a, const pooled_allocator<U>& b)
+{
+    return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!=(const pooled_allocator<T>& a, const pooled_allocator<U>& b)
+{
+    return a.pool != b.pool;
+}
+
+#endif // BITCOIN_SUPPORT_ALLOCATORS_POOLED_H
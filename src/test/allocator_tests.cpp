@@ -4,6 +4,7 @@
 
 #include "util.h"
 
+#include "support/allocators/pooled.h"
 #include "support/allocators/secure.h"
 #include "test/test_digitalcoin.h"
 
@@ -117,4 +118,38 @@ BOOST_AUTO_TEST_CASE(test_LockedPageManagerBase)
     BOOST_CHECK((last_unlock_len & (test_page_size-1)) == 0); // always unlock entire pages
 }
 
+BOOST_AUTO_TEST_CASE(pooled_allocator_reuse)
+{
+    CNodePool pool(2);
+    size_t nEmptyUsage = pool.DynamicMemoryUsage();
+    {
+        pooled_allocator<std::pair<const int, int> > alloc(&pool);
+        std::map<int, int, std::less<int>, pooled_allocator<std::pair<const int, int> > > m(std::less<int>(), alloc);
+        for (int i = 0; i < 4; i++)
+            m[i] = i;
+        const int* pFirst = &m[0];
+        m.erase(0);
+        BOOST_CHECK(pool.DynamicMemoryUsage() > nEmptyUsage);
+        // The freed node is handed out again for the next insert
+        m[4] = 4;
+        BOOST_CHECK(&m[4] == pFirst);
+    }
+    size_t nPooledUsage = pool.DynamicMemoryUsage();
+    pool.Clear();
+    size_t nClearedUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nClearedUsage < nPooledUsage);
+
+    // Hash table nodes are pooled as well, their bucket arrays are not
+    {
+        pooled_allocator<std::pair<const int, int> > alloc(&pool);
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, pooled_allocator<std::pair<const int, int> > > m(0, std::hash<int>(), std::equal_to<int>(), alloc);
+        for (int i = 0; i < 100; i++)
+            m[i] = i;
+    }
+    nPooledUsage = pool.DynamicMemoryUsage();
+    BOOST_CHECK(nPooledUsage > nClearedUsage);
+    pool.Clear();
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nPooledUsage);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -209,10 +209,14 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         }
 
         if (insecure_rand() % 100 == 0) {
-            // Every 100 iterations, flush an intermediate cache
+            // Every 100 iterations, flush or sync an intermediate cache
             if (stack.size() > 1 && insecure_rand() % 2 == 0) {
                 unsigned int flushIndex = insecure_rand() % (stack.size() - 1);
-                stack[flushIndex]->Flush();
+                if (insecure_rand() % 2 == 0) {
+                    stack[flushIndex]->Flush();
+                } else {
+                    stack[flushIndex]->Sync();
+                }
             }
         }
         if (insecure_rand() % 100 == 0) {
@@ -860,4 +864,34 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+void CheckCacheCoin(CAmount cache_value, CAmount expected_value, char cache_flags, char expected_flags)
+{
+    SingleEntryCacheTest test(ABSENT, cache_value, cache_flags);
+    Coin coin;
+    SetCoinsValue(VALUE3, coin);
+    test.cache.CacheCoin(OUTPOINT, std::move(coin));
+    test.cache.SelfTest();
+
+    CAmount result_value;
+    char result_flags;
+    GetCoinsMapEntry(test.cache.map(), result_value, result_flags);
+    BOOST_CHECK_EQUAL(result_value, expected_value);
+    BOOST_CHECK_EQUAL(result_flags, expected_flags);
+}
+
+BOOST_AUTO_TEST_CASE(ccoins_cache_coin)
+{
+    /* Check CacheCoin behavior, adding a coin read from the base view by
+     * someone else to the cache. Entries already in the cache are kept as
+     * they are.
+     *
+     *              Cache   Result  Cache        Result
+     *              Value   Value   Flags        Flags
+     */
+    CheckCacheCoin(ABSENT, VALUE3, NO_ENTRY   , 0          );
+    for (CAmount cache_value : {PRUNED, VALUE1})
+        for (char cache_flags : FLAGS)
+            CheckCacheCoin(cache_value, cache_value, cache_flags, cache_flags);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,11 +3,16 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "compressor.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
 #include "util.h"
 #include "test/test_digitalcoin.h"
 
 #include <stdint.h>
+#include <vector>
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 // amounts 0.00000001 .. 0.00100000
@@ -62,4 +67,115 @@ BOOST_AUTO_TEST_CASE(compress_amounts)
         BOOST_CHECK(TestDecode(i));
 }
 
+BOOST_AUTO_TEST_CASE(compress_blocks)
+{
+    CBlock block;
+    block.nVersion = 0x20000000;
+    block.hashPrevBlock = GetRandHash();
+    block.hashMerkleRoot = GetRandHash();
+    block.nTime = 1500000000;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 42;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vin[0].scriptSig = CScript() << 100 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].nValue = 50 * COIN;
+    coinbase.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x11) << OP_EQUALVERIFY << OP_CHECKSIG;
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+
+    CMutableTransaction spend;
+    spend.nVersion = -5;
+    spend.nLockTime = 499999999;
+    spend.vin.resize(2);
+    spend.vin[0].prevout = COutPoint(GetRandHash(), 3);
+    spend.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72, 0x30);
+    spend.vin[1].prevout = COutPoint(GetRandHash(), 0);
+    spend.vin[1].nSequence = 0x12345;
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 12345;
+    spend.vout[0].scriptPubKey = CScript() << OP_HASH160 << std::vector<unsigned char>(20, 0x22) << OP_EQUAL;
+    spend.vout[1].nValue = 0;
+    spend.vout[1].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(40, 0x33);
+    block.vtx.push_back(MakeTransactionRef(spend));
+
+    BOOST_CHECK(CTxCompressor::CanCompress(*block.vtx[1]));
+
+    // Uncompressed records are the network format
+    CDataStream ssNetwork(SER_DISK, CLIENT_VERSION);
+    ssNetwork << block;
+    CDataStream ssRaw(SER_DISK, CLIENT_VERSION);
+    ssRaw << CBlockCompressor(block, false);
+    BOOST_CHECK(std::vector<char>(ssRaw.begin(), ssRaw.end()) == std::vector<char>(ssNetwork.begin(), ssNetwork.end()));
+
+    CDataStream ssCompressed(SER_DISK, CLIENT_VERSION);
+    ssCompressed << CBlockCompressor(block, true);
+    BOOST_CHECK(ssCompressed.size() < ssNetwork.size());
+
+    // Both are read back through the same wrapper
+    CDataStream* streams[] = {&ssRaw, &ssCompressed};
+    BOOST_FOREACH(CDataStream* ss, streams) {
+        CBlock blockRead;
+        CBlockCompressor blockIn(blockRead);
+        *ss >> blockIn;
+        BOOST_CHECK(ss->empty());
+        BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+        BOOST_CHECK_EQUAL(blockRead.vtx.size(), block.vtx.size());
+        for (unsigned int i = 0; i < block.vtx.size(); i++)
+            BOOST_CHECK(*blockRead.vtx[i] == *block.vtx[i]);
+    }
+
+    // Scripts CScriptCompressor would replace keep their transaction in the
+    // network format, so any block survives, including one whose version
+    // equals the marker
+    spend.vout[1].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(MAX_SCRIPT_SIZE, 0x44);
+    block.vtx[1] = MakeTransactionRef(spend);
+    block.nVersion = COMPRESSED_BLOCK_MARKER;
+    BOOST_CHECK(!CTxCompressor::CanCompress(*block.vtx[1]));
+    CDataStream ssMixed(SER_DISK, CLIENT_VERSION);
+    ssMixed << CBlockCompressor(block, true);
+    CBlock blockRead;
+    CBlockCompressor blockIn(blockRead);
+    ssMixed >> blockIn;
+    BOOST_CHECK(ssMixed.empty());
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockRead.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(*blockRead.vtx[i] == *block.vtx[i]);
+
+    // Large output indexes and sequence numbers take five bytes as VARINTs,
+    // such a transaction stays in the network format so that the record is
+    // only larger by the marker and the flag
+    CMutableTransaction wide;
+    wide.nLockTime = 0xffffffff;
+    wide.vin.resize(10);
+    for (unsigned int i = 0; i < wide.vin.size(); i++) {
+        wide.vin[i].prevout = COutPoint(GetRandHash(), 0xfffffffe);
+        wide.vin[i].nSequence = 0;
+    }
+    wide.vout.resize(1);
+    wide.vout[0].nValue = 1;
+    wide.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CDataStream ssWideNetwork(SER_DISK, CLIENT_VERSION);
+    ssWideNetwork << wide;
+    CDataStream ssWideCompressed(SER_DISK, CLIENT_VERSION);
+    ssWideCompressed << CTxCompressor(wide);
+    BOOST_CHECK(ssWideCompressed.size() > ssWideNetwork.size());
+
+    block.vtx.assign(1, MakeTransactionRef(wide));
+    CDataStream ssNetworkWide(SER_DISK, CLIENT_VERSION);
+    ssNetworkWide << block;
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord << CBlockCompressor(block, true);
+    BOOST_CHECK_EQUAL(ssRecord.size(), ssNetworkWide.size() + sizeof(COMPRESSED_BLOCK_MARKER) + 1);
+    BOOST_CHECK(ssRecord.size() <= MaxCompressedBlockSize(ssNetworkWide.size()));
+    CBlock blockWide;
+    CBlockCompressor blockWideIn(blockWide);
+    ssRecord >> blockWideIn;
+    BOOST_CHECK(blockWide.GetHash() == block.GetHash());
+    BOOST_CHECK(*blockWide.vtx[0] == *block.vtx[0]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -6,11 +6,13 @@
 #include "chainparams.h"
 #include "validation.h"
 #include "net.h"
+#include "utiltime.h"
 
 #include "test/test_digitalcoin.h"
 
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
 
@@ -79,4 +81,55 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+BOOST_FIXTURE_TEST_CASE(block_prefetch, TestChain100Setup)
+{
+    boost::thread threadPrefetch(ThreadBlockPrefetch);
+    {
+        LOCK(cs_main);
+        std::vector<CBlockIndex*> vpindex;
+        BOOST_REQUIRE(chainActive.Height() >= 3);
+        for (int nHeight = 1; nHeight <= chainActive.Height(); nHeight++)
+            vpindex.push_back(chainActive[nHeight]);
+        PrefetchBlocks(vpindex);
+
+        // The thread must only use the position copied when the blocks were queued
+        CBlockIndex* pindexLast = vpindex.back();
+        unsigned int nDataPos = pindexLast->nDataPos;
+        pindexLast->nDataPos = 0;
+
+        // A single thread reads in connect order, so once the last block is there all of them are
+        std::shared_ptr<const CBlock> pblock;
+        for (int i = 0; i < 1000 && !pblock; i++) {
+            pblock = TakePrefetchedBlock(pindexLast);
+            if (!pblock)
+                MilliSleep(10);
+        }
+        pindexLast->nDataPos = nDataPos;
+        BOOST_REQUIRE(pblock);
+        BOOST_CHECK(pblock->GetHash() == pindexLast->GetBlockHash());
+        BOOST_CHECK(pblock->fPrechecked);
+
+        pblock = TakePrefetchedBlock(vpindex[0]);
+        BOOST_REQUIRE(pblock);
+        BOOST_CHECK(pblock->GetHash() == vpindex[0]->GetBlockHash());
+        BOOST_CHECK(pblock->fPrechecked);
+
+        // Blocks are handed out once, and only if they were asked for
+        BOOST_CHECK(!TakePrefetchedBlock(vpindex[0]));
+        BOOST_CHECK(!TakePrefetchedBlock(pindexLast));
+        BOOST_CHECK(!TakePrefetchedBlock(chainActive.Genesis()));
+
+        // A new request drops the blocks that aren't wanted anymore
+        PrefetchBlocks(std::vector<CBlockIndex*>(1, vpindex[1]));
+        BOOST_CHECK(!TakePrefetchedBlock(vpindex[2]));
+        pblock = TakePrefetchedBlock(vpindex[1]);
+        BOOST_REQUIRE(pblock);
+        BOOST_CHECK(pblock->GetHash() == vpindex[1]->GetBlockHash());
+
+        PrefetchBlocks(std::vector<CBlockIndex*>());
+    }
+    threadPrefetch.interrupt();
+    threadPrefetch.join();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
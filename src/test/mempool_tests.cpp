@@ -54,7 +54,7 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     // Nothing in pool, remove should do nothing:
     testPool.remove(txParent, removed, true);
@@ -280,7 +280,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK_EQUAL(pool.size(), 10);
 
     // Now try removing tx10 and verify the sort order returns to normal
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
     pool.remove(pool.mapTx.find(tx10.GetHash())->GetTx(), removed, true);
     CheckSort<1>(pool, snapshotOrder);
 
@@ -443,8 +443,8 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    std::vector<CTransaction> vtx;
-    std::list<CTransaction> conflicts;
+    std::vector<CTransactionRef> vtx;
+    std::list<CTransactionRef> conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
     BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
@@ -473,4 +473,71 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorStateTest)
+{
+    // A chain tx1 <- tx2 <- tx3, each entry caches its ancestor package
+    TestMemPoolEntryHelper entry;
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx[3];
+    for (int i = 0; i < 3; i++) {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11;
+        if (i > 0)
+            tx[i].vin[0].prevout = COutPoint(tx[i-1].GetHash(), 0);
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = (10 - i) * COIN;
+    }
+    int64_t nTxSize = ::GetSerializeSize(tx[0], SER_NETWORK, PROTOCOL_VERSION);
+
+    for (int i = 0; i < 3; i++)
+        pool.addUnchecked(tx[i].GetHash(), entry.Fee(1000LL * (i + 1)).SigOps(i + 1).FromTx(tx[i]));
+
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx[2].GetHash());
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6000LL);
+    BOOST_CHECK_EQUAL(it3->GetSigOpCountWithAncestors(), 6);
+
+    // Prioritising an ancestor is reflected in its descendants
+    pool.PrioritiseTransaction(tx[0].GetHash(), tx[0].GetHash().ToString(), 0.0, 500LL);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6500LL);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[1].GetHash())->GetModFeesWithAncestors(), 3500LL);
+
+    // Mining tx1 takes it out of the packages of the remaining entries
+    std::vector<CTransactionRef> vtx(1, MakeTransactionRef(tx[0]));
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts, false);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), 2 * nTxSize);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 5000LL);
+    BOOST_CHECK_EQUAL(it3->GetSigOpCountWithAncestors(), 5);
+
+    // Disconnecting the block puts tx1 back in front of its descendants
+    pool.addUnchecked(tx[0].GetHash(), entry.Fee(1000LL).SigOps(1).FromTx(tx[0]));
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2);
+    pool.UpdateTransactionsFromBlock(std::vector<uint256>(1, tx[0].GetHash()));
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it3->GetSizeWithAncestors(), 3 * nTxSize);
+    BOOST_CHECK_EQUAL(it3->GetSigOpCountWithAncestors(), 6);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx[0].GetHash())->GetCountWithDescendants(), 3);
+
+    // Ancestor limits reject from the parent's cached state
+    CMutableTransaction tx4;
+    tx4.vin.resize(1);
+    tx4.vin[0].scriptSig = CScript() << OP_11;
+    tx4.vin[0].prevout = COutPoint(tx[2].GetHash(), 0);
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 5 * COIN;
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(tx4), setAncestors, 3, 1000000, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(errString, "too many unconfirmed ancestors [limit: 3]");
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(tx4), setAncestors, 4, 1000000, 1000, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "net.h"
 #include "netbase.h"
 #include "chainparams.h"
+#include "random.h"
 
 using namespace std;
 
@@ -174,4 +175,118 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(inventory_tx_batch)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(0, NODE_NETWORK, 0, INVALID_SOCKET, addr, "", false);
+
+    std::vector<uint256> vBatched;
+    uint256 hashImmediate;
+    while (vBatched.size() < 3 || hashImmediate.IsNull()) {
+        uint256 hash = GetRandHash();
+        if (CNode::IsInventoryTxImmediate(hash))
+            hashImmediate = hash;
+        else if (vBatched.size() < 3)
+            vBatched.push_back(hash);
+    }
+
+    LOCK(node.cs_inventory);
+    BOOST_FOREACH(const uint256& hash, vBatched)
+        node.PushInventory(CInv(MSG_TX, hash));
+    node.PushInventory(CInv(MSG_TX, vBatched[0]));
+    node.PushInventory(CInv(MSG_TX, hashImmediate));
+
+    // Only the immediate one goes out on the next pass
+    BOOST_CHECK_EQUAL(node.vInventoryToSend.size(), 1U);
+    BOOST_CHECK(node.vInventoryToSend[0].hash == hashImmediate);
+    BOOST_CHECK_EQUAL(node.vInventoryTxToSend.size(), 4U);
+
+    // The batch drops the duplicate and what the peer announced to us meanwhile
+    node.filterInventoryKnown.insert(vBatched[2]);
+    std::vector<CInv> vInv;
+    node.TakeInventoryTxBatch(vInv, GetTimeMicros());
+    BOOST_CHECK_EQUAL(vInv.size(), 2U);
+    BOOST_CHECK(vInv[0] == CInv(MSG_TX, vBatched[0]));
+    BOOST_CHECK(vInv[1] == CInv(MSG_TX, vBatched[1]));
+    BOOST_CHECK(node.vInventoryTxToSend.empty());
+    BOOST_CHECK_EQUAL(node.nInvTxSent, 2U);
+
+    // Announced transactions aren't queued again
+    node.PushInventory(CInv(MSG_TX, vBatched[1]));
+    BOOST_CHECK(node.vInventoryTxToSend.empty());
+
+    // A full queue drops further announcements
+    while (node.vInventoryTxToSend.size() < MAX_INV_TX_QUEUE)
+        node.PushInventory(CInv(MSG_TX, GetRandHash()));
+    BOOST_CHECK_EQUAL(node.nInvTxDropped, 0U);
+    while (node.nInvTxDropped == 0)
+        node.PushInventory(CInv(MSG_TX, GetRandHash()));
+    BOOST_CHECK_EQUAL(node.vInventoryTxToSend.size(), MAX_INV_TX_QUEUE);
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_pool)
+{
+    CNetRecvBufferPool pool;
+    CSerializeData data;
+    pool.Put(data);
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
+
+    data.resize(1000);
+    size_t nCapacity = data.capacity();
+    pool.Put(data);
+    BOOST_CHECK_EQUAL(pool.Size(), 1U);
+    BOOST_CHECK_EQUAL(pool.PooledSize(), nCapacity);
+
+    // The pooled storage is handed out again, empty
+    CSerializeData data2;
+    pool.Get(data2, 100);
+    BOOST_CHECK(data2.empty());
+    BOOST_CHECK_EQUAL(data2.capacity(), nCapacity);
+    BOOST_CHECK_EQUAL(pool.Size(), 0U);
+    BOOST_CHECK_EQUAL(pool.PooledSize(), 0U);
+
+    // Best fit: the smallest buffer that is large enough
+    CSerializeData small, large;
+    small.reserve(500);
+    large.reserve(5000);
+    pool.Put(large);
+    pool.Put(data2);
+    pool.Put(small);
+    CSerializeData data3;
+    pool.Get(data3, 800);
+    BOOST_CHECK_EQUAL(data3.capacity(), nCapacity);
+    pool.Get(data3, 10000);
+    BOOST_CHECK(data3.capacity() >= 10000);
+    BOOST_CHECK_EQUAL(pool.Size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(cnetmessage_read)
+{
+    std::vector<char> vPayload(300 * 1024);
+    for (size_t i = 0; i < vPayload.size(); i++)
+        vPayload[i] = (char)i;
+    CMessageHeader hdr(Params().MessageStart(), NetMsgType::BLOCK, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss.write(vPayload.data(), vPayload.size());
+
+    // Feed the message in socket sized chunks
+    CNetMessage msg(Params().MessageStart(), SER_NETWORK, PROTOCOL_VERSION);
+    const char* pch = ss.data();
+    unsigned int nBytes = ss.size();
+    while (nBytes > 0) {
+        int handled = msg.in_data ? msg.readData(pch, std::min(nBytes, 0x10000U)) : msg.readHeader(pch, std::min(nBytes, 0x10000U));
+        BOOST_CHECK(handled > 0);
+        pch += handled;
+        nBytes -= handled;
+    }
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), vPayload.size());
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msg.vRecv.begin()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,165 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "privatesend.h"
+
+#include "chain.h"
+#include "masternode-sync.h"
+#include "random.h"
+#include "utiltime.h"
+#include "validation.h"
+
+#include "test/test_digitalcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(privatesend_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(queue_index)
+{
+    int64_t nNow = GetTime();
+    SetMockTime(nNow);
+
+    COutPoint mn1(GetRandHash(), 0), mn2(GetRandHash(), 1), mn3(GetRandHash(), 2), mn4(GetRandHash(), 3);
+    CDarksendQueue dsq1(1, mn1, nNow - 10, false);
+    CDarksendQueue dsq2(1, mn2, nNow - 5, false);
+    CDarksendQueue dsq3(2, mn1, nNow, true);
+    CDarksendQueue dsqTried(1, mn3, nNow, false);
+    dsqTried.fTried = true;
+
+    CDarksendQueueIndex queues;
+    queues.Add(dsq1);
+    queues.Add(dsq2);
+    queues.Add(dsq3);
+    queues.Add(dsqTried);
+    BOOST_CHECK_EQUAL(queues.size(), 4U);
+
+    BOOST_CHECK(queues.Has(dsq1));
+    BOOST_CHECK(queues.Has(dsq3));
+    BOOST_CHECK(!queues.Has(CDarksendQueue(1, mn1, nNow - 9, false)));
+    BOOST_CHECK(!queues.Has(CDarksendQueue(1, mn4, nNow - 10, false)));
+    BOOST_CHECK(queues.HasMasternode(mn1));
+    BOOST_CHECK(queues.HasMasternode(mn3));
+    BOOST_CHECK(!queues.HasMasternode(mn4));
+
+    // Untried queues come out in arrival order, each only once
+    CDarksendQueue dsq;
+    BOOST_CHECK(queues.PopUntried(dsq));
+    BOOST_CHECK(dsq == dsq1 && dsq.fTried);
+    BOOST_CHECK(queues.PopUntried(dsq));
+    BOOST_CHECK(dsq == dsq2);
+    BOOST_CHECK(queues.PopUntried(dsq));
+    BOOST_CHECK(dsq == dsq3);
+    BOOST_CHECK(!queues.PopUntried(dsq));
+
+    // Tried queues stay around until they expire
+    BOOST_CHECK_EQUAL(queues.size(), 4U);
+    BOOST_CHECK(queues.Has(dsq1));
+
+    // Only the oldest queue has expired, its masternode still has another one
+    SetMockTime(nNow - 10 + PRIVATESEND_QUEUE_TIMEOUT + 1);
+    CDarksendQueue dsq4(4, mn4, nNow, false);
+    queues.Add(dsq4);
+    queues.RemoveExpired();
+    BOOST_CHECK_EQUAL(queues.size(), 4U);
+    BOOST_CHECK(!queues.Has(dsq1));
+    BOOST_CHECK(queues.Has(dsq2));
+    BOOST_CHECK(queues.HasMasternode(mn1));
+
+    // Everything else expires, including the queue nobody tried yet
+    SetMockTime(nNow + PRIVATESEND_QUEUE_TIMEOUT + 1);
+    queues.RemoveExpired();
+    BOOST_CHECK_EQUAL(queues.size(), 0U);
+    BOOST_CHECK(!queues.Has(dsq3));
+    BOOST_CHECK(!queues.Has(dsq4));
+    BOOST_CHECK(!queues.HasMasternode(mn1));
+    BOOST_CHECK(!queues.HasMasternode(mn2));
+    BOOST_CHECK(!queues.HasMasternode(mn3));
+    BOOST_CHECK(!queues.HasMasternode(mn4));
+    BOOST_CHECK(!queues.PopUntried(dsq));
+
+    // The index is still usable once emptied
+    queues.Add(dsq4);
+    BOOST_CHECK(queues.HasMasternode(mn4));
+    BOOST_CHECK(queues.PopUntried(dsq));
+    BOOST_CHECK(dsq == dsq4);
+
+    SetMockTime(0);
+}
+
+static CTransactionRef AddTestDSTX(uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), n);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+    CTransactionRef ptx = MakeTransactionRef(tx);
+    CPrivateSend::AddDSTX(CDarksendBroadcastTx(ptx, COutPoint(GetRandHash(), 0), GetTime()));
+    return ptx;
+}
+
+static void UpdateTipHeight(int nHeight)
+{
+    CBlockIndex index;
+    index.nHeight = nHeight;
+    CPrivateSend::UpdatedBlockTip(&index);
+}
+
+BOOST_FIXTURE_TEST_CASE(dstx_expiry, TestChain100Setup)
+{
+    // DSTXes are only expired once the masternode list is synced
+    for (int i = 0; i < 3; i++)
+        masternodeSync.SwitchToNextAsset(*connman);
+    BOOST_REQUIRE(masternodeSync.IsMasternodeListSynced());
+    BOOST_REQUIRE(chainActive.Height() >= 3);
+
+    CTransactionRef ptx1 = AddTestDSTX(1);
+    CTransactionRef ptx2 = AddTestDSTX(2);
+    CTransactionRef ptxUnconfirmed = AddTestDSTX(3);
+
+    const CBlock block1(chainActive[1]->GetBlockHeader());
+    const CBlock block2(chainActive[2]->GetBlockHeader());
+    const CBlock block3(chainActive[3]->GetBlockHeader());
+    CPrivateSend::SyncTransaction(*ptx1, &block1);
+    CPrivateSend::SyncTransaction(*ptx2, &block2);
+    BOOST_CHECK_EQUAL(CPrivateSend::GetDSTX(ptx1->GetHash()).GetConfirmedHeight(), 1);
+
+    // Confirmed DSTXes are kept for 24 blocks after their confirmation
+    UpdateTipHeight(1 + 24);
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptx1->GetHash()));
+    UpdateTipHeight(1 + 25);
+    BOOST_CHECK(!CPrivateSend::GetDSTX(ptx1->GetHash()));
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptx2->GetHash()));
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptxUnconfirmed->GetHash()));
+
+    // A DSTX whose block was disconnected leaves its height bucket, and is
+    // expired from the height of the block it confirms in next
+    CPrivateSend::SyncTransaction(*ptx2, NULL);
+    BOOST_CHECK_EQUAL(CPrivateSend::GetDSTX(ptx2->GetHash()).GetConfirmedHeight(), -1);
+    UpdateTipHeight(2 + 25);
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptx2->GetHash()));
+    CPrivateSend::SyncTransaction(*ptx2, &block3);
+    UpdateTipHeight(3 + 24);
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptx2->GetHash()));
+    UpdateTipHeight(3 + 25);
+    BOOST_CHECK(!CPrivateSend::GetDSTX(ptx2->GetHash()));
+
+    // Unconfirmed DSTXes never expire by height
+    UpdateTipHeight(1000);
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptxUnconfirmed->GetHash()));
+
+    // Nor does anything expire before the masternode list is synced
+    masternodeSync.Reset();
+    CPrivateSend::SyncTransaction(*ptxUnconfirmed, &block1);
+    UpdateTipHeight(1000);
+    BOOST_CHECK(CPrivateSend::GetDSTX(ptxUnconfirmed->GetHash()));
+    for (int i = 0; i < 3; i++)
+        masternodeSync.SwitchToNextAsset(*connman);
+    UpdateTipHeight(1000);
+    BOOST_CHECK(!CPrivateSend::GetDSTX(ptxUnconfirmed->GetHash()));
+    masternodeSync.Reset();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
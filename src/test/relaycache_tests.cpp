@@ -0,0 +1,135 @@
+// Copyright (c) 2017 The Digitalcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+
+#include "test/test_digitalcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(relaycache_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTx(uint32_t n)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = n;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = n;
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_find)
+{
+    CRelayCache cache;
+    CTransactionRef tx = MakeTx(1);
+    CInv inv(MSG_TX, tx->GetHash());
+
+    BOOST_CHECK(!cache.Find(inv, 1000));
+    cache.Insert(inv, tx, 1000);
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+    // The cache shares the transaction instead of copying it
+    BOOST_CHECK(cache.Find(inv, 1000) == tx);
+    // Lock requests for the same transaction are separate entries
+    BOOST_CHECK(!cache.Find(CInv(MSG_TXLOCK_REQUEST, tx->GetHash()), 1000));
+
+    // Entries expire
+    BOOST_CHECK(cache.Find(inv, 1000 + RELAY_CACHE_EXPIRY) == tx);
+    BOOST_CHECK(!cache.Find(inv, 1001 + RELAY_CACHE_EXPIRY));
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+    BOOST_CHECK_EQUAL(cache.Usage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_lru)
+{
+    std::vector<CTransactionRef> vtx;
+    for (uint32_t i = 0; i < 3; i++)
+        vtx.push_back(MakeTx(i));
+
+    // Find out how much memory a single entry accounts for
+    CRelayCache probe;
+    probe.Insert(CInv(MSG_TX, vtx[0]->GetHash()), vtx[0], 1000);
+    size_t nEntry = probe.Usage();
+
+    CRelayCache cache(2 * nEntry);
+    cache.Insert(CInv(MSG_TX, vtx[0]->GetHash()), vtx[0], 1000);
+    cache.Insert(CInv(MSG_TX, vtx[1]->GetHash()), vtx[1], 1000);
+    BOOST_CHECK_EQUAL(cache.Size(), 2);
+
+    // Touch the oldest entry, so the second one is evicted next
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[0]->GetHash()), 1000));
+    cache.Insert(CInv(MSG_TX, vtx[2]->GetHash()), vtx[2], 1000);
+    BOOST_CHECK_EQUAL(cache.Size(), 2);
+    BOOST_CHECK_EQUAL(cache.Evicted(), 1);
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[0]->GetHash()), 1000));
+    BOOST_CHECK(!cache.Find(CInv(MSG_TX, vtx[1]->GetHash()), 1000));
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[2]->GetHash()), 1000));
+
+    // Lowering the limit trims right away
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_message)
+{
+    CRelayCache cache;
+    CTransactionRef tx = MakeTx(1);
+    CInv inv(MSG_TX, tx->GetHash());
+    CSerializedNetMsg msg = std::make_shared<const CSerializeData>(1000, 'x');
+
+    // Messages are only kept for inventory we relayed
+    cache.InsertMessage(inv, msg, 1000);
+    BOOST_CHECK(!cache.FindMessage(inv, 1000));
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+    BOOST_CHECK_EQUAL(cache.Usage(), 0);
+
+    cache.Insert(inv, CTransactionRef(), 1000);
+    cache.InsertMessage(inv, msg, 1000);
+    BOOST_CHECK(cache.FindMessage(inv, 1000) == msg);
+    BOOST_CHECK(!cache.Find(inv, 1000));
+    BOOST_CHECK(cache.Usage() > msg->size());
+
+    // A later announcement attaches the transaction to the same entry
+    cache.Insert(inv, tx, 1000);
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+    BOOST_CHECK(cache.Find(inv, 1000) == tx);
+    BOOST_CHECK(cache.FindMessage(inv, 1000) == msg);
+
+    // Replacing the message keeps the accounting straight
+    size_t nUsage = cache.Usage();
+    cache.InsertMessage(inv, std::make_shared<const CSerializeData>(1000, 'y'), 1000);
+    BOOST_CHECK_EQUAL(cache.Usage(), nUsage);
+
+    BOOST_CHECK(!cache.FindMessage(inv, 1001 + RELAY_CACHE_EXPIRY));
+    BOOST_CHECK_EQUAL(cache.Usage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_expiry_order)
+{
+    std::vector<CTransactionRef> vtx;
+    for (uint32_t i = 0; i < 3; i++)
+        vtx.push_back(MakeTx(i));
+
+    CRelayCache cache;
+    cache.Insert(CInv(MSG_TX, vtx[0]->GetHash()), vtx[0], 1000);
+    cache.Insert(CInv(MSG_TX, vtx[1]->GetHash()), vtx[1], 1000 + RELAY_CACHE_EXPIRY / 2);
+    // Using the first entry makes it the most recently used one, but doesn't
+    // extend its expiry
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[0]->GetHash()), 1000 + RELAY_CACHE_EXPIRY / 2));
+
+    // It is still dropped on the next insertion after it expired, while the
+    // least recently used entry isn't due yet
+    cache.Insert(CInv(MSG_TX, vtx[2]->GetHash()), vtx[2], 1001 + RELAY_CACHE_EXPIRY);
+    BOOST_CHECK_EQUAL(cache.Size(), 2);
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[1]->GetHash()), 1001 + RELAY_CACHE_EXPIRY));
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[2]->GetHash()), 1001 + RELAY_CACHE_EXPIRY));
+
+    // Announcing again moves the expiry out
+    cache.Insert(CInv(MSG_TX, vtx[1]->GetHash()), vtx[1], 1001 + RELAY_CACHE_EXPIRY);
+    BOOST_CHECK(cache.Find(CInv(MSG_TX, vtx[1]->GetHash()), 1000 + 2 * RELAY_CACHE_EXPIRY));
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.Usage(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
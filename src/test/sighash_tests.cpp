@@ -160,12 +160,64 @@ BOOST_AUTO_TEST_CASE(sighash_test)
         std::cout << "\n";
         #endif
         BOOST_CHECK(sh == sho);
+
+        PrecomputedTransactionData txdata(txTo);
+        BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &txdata) == sho);
     }
     #if defined(PRINT_SIGHASH_JSON)
     std::cout << "]\n";
     #endif
 }
 
+// Goal: check that the precomputed SIGHASH_ALL path matches for every input of big transactions
+BOOST_AUTO_TEST_CASE(sighash_precomputed)
+{
+    seed_insecure_rand(false);
+
+    for (int i=0; i<50; i++) {
+        CMutableTransaction txMutable;
+        RandomTransaction(txMutable, false);
+        while (txMutable.vin.size() < 100) {
+            txMutable.vin.push_back(txMutable.vin.back());
+            txMutable.vin.back().prevout.hash = GetRandHash();
+            txMutable.vin.back().nSequence = insecure_rand();
+        }
+        const CTransaction txTo(txMutable);
+        PrecomputedTransactionData txdata(txTo);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+
+        for (unsigned int nIn = 0; nIn < txTo.vin.size(); nIn++) {
+            // SIGHASH_SINGLE is left out, there are more inputs than outputs
+            int nHashType = (insecure_rand() & ~0x1f) | ((insecure_rand() % 2) ? SIGHASH_ALL : SIGHASH_NONE);
+            BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashType, &txdata) == SignatureHashOld(scriptCode, txTo, nIn, nHashType));
+        }
+    }
+}
+
+// Goal: check the precomputed data against the reference implementation for every hash type
+BOOST_AUTO_TEST_CASE(sighash_precomputed_hashtypes)
+{
+    seed_insecure_rand(false);
+
+    static const int nHashTypes[] = {SIGHASH_ALL, SIGHASH_ALL | SIGHASH_ANYONECANPAY, SIGHASH_NONE,
+            SIGHASH_NONE | SIGHASH_ANYONECANPAY, SIGHASH_SINGLE, SIGHASH_SINGLE | SIGHASH_ANYONECANPAY};
+
+    for (int i=0; i<5000; i++) {
+        CMutableTransaction txMutable;
+        RandomTransaction(txMutable, (i % 2) == 0);
+        const CTransaction txTo(txMutable);
+        PrecomputedTransactionData txdata(txTo);
+        CScript scriptCode;
+        RandomScript(scriptCode);
+        unsigned int nIn = insecure_rand() % txTo.vin.size();
+
+        for (unsigned int n = 0; n < ARRAYLEN(nHashTypes); n++) {
+            BOOST_CHECK(SignatureHash(scriptCode, txTo, nIn, nHashTypes[n], &txdata) == SignatureHashOld(scriptCode, txTo, nIn, nHashTypes[n]));
+        }
+    }
+}
+
 // Goal: check that SignatureHash generates correct hash
 BOOST_AUTO_TEST_CASE(sighash_from_data)
 {
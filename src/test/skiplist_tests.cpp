@@ -100,4 +100,72 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(chainview_test)
+{
+    // Build a main chain and a branch that splits off halfway.
+    std::vector<CBlockIndex> vBlocksMain(10000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].BuildSkip();
+    }
+    std::vector<CBlockIndex> vBlocksSide(5000);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vBlocksSide[i].nHeight = i + 5000;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[4999];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    // A view answers the same as a CChain with the same tip.
+    CChain chain;
+    chain.SetTip(&vBlocksMain.back());
+    CChainView view(&vBlocksMain.back());
+    BOOST_CHECK(view.Tip() == chain.Tip());
+    BOOST_CHECK(view.Genesis() == chain.Genesis());
+    BOOST_CHECK_EQUAL(view.Height(), chain.Height());
+    BOOST_CHECK(view[-1] == NULL);
+    BOOST_CHECK(view[chain.Height() + 1] == NULL);
+    for (int n=0; n<1000; n++) {
+        int r = insecure_rand() % 15000;
+        CBlockIndex* pindex = (r < 10000) ? &vBlocksMain[r] : &vBlocksSide[r - 10000];
+        BOOST_CHECK(view[pindex->nHeight] == chain[pindex->nHeight]);
+        BOOST_CHECK_EQUAL(view.Contains(pindex), chain.Contains(pindex));
+        BOOST_CHECK(view.Next(pindex) == chain.Next(pindex));
+    }
+
+    // An empty view contains nothing.
+    CChainView empty;
+    BOOST_CHECK(empty.Tip() == NULL && empty.Genesis() == NULL);
+    BOOST_CHECK_EQUAL(empty.Height(), -1);
+    BOOST_CHECK(!empty.Contains(&vBlocksMain[0]));
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_arena_test)
+{
+    // Build a chain spanning several arena chunks and walk it back.
+    CBlockIndexArena arena;
+    std::vector<CBlockIndex*> vpindex;
+    for (int i=0; i<SKIPLIST_LENGTH / 10; i++) {
+        CBlockIndex* pindex = arena.Create();
+        BOOST_CHECK(pindex->pprev == NULL && pindex->nChainWork == 0);
+        pindex->nHeight = i;
+        pindex->pprev = (i == 0) ? NULL : vpindex.back();
+        pindex->BuildSkip();
+        vpindex.push_back(pindex);
+    }
+    BOOST_CHECK_EQUAL(arena.size(), vpindex.size());
+    BOOST_CHECK(arena.DynamicMemoryUsage() >= vpindex.size() * sizeof(CBlockIndex));
+
+    for (int i=0; i < 1000; i++) {
+        int from = insecure_rand() % vpindex.size();
+        int to = insecure_rand() % (from + 1);
+        BOOST_CHECK(vpindex[from]->GetAncestor(to) == vpindex[to]);
+        BOOST_CHECK_EQUAL(vpindex[from]->nHeight, from);
+    }
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.size(), 0U);
+    BOOST_CHECK_EQUAL(arena.DynamicMemoryUsage(), 0U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
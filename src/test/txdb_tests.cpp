@@ -0,0 +1,214 @@
+// Copyright (c) 2014-2017 The Dash Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txdb.h"
+#include "chain.h"
+#include "coins.h"
+#include "random.h"
+#include "script/script.h"
+#include "validation.h"
+#include "test/test_digitalcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+//! Coins DB whose batches can be frozen without starting the writer thread
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void Freeze(CCoinsMap& mapCoins, const uint256& hashBlock)
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        pcoinsFrozen.reset(new CCoinsMap(std::move(mapCoins)));
+        hashBlockFrozen = hashBlock;
+    }
+
+    bool HasFrozen() const
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        return pcoinsFrozen != nullptr;
+    }
+
+    using CCoinsViewDB::WriteFrozen;
+};
+
+void AddDirty(CCoinsMap& mapCoins, const COutPoint& outpoint, CAmount nValue)
+{
+    CCoinsCacheEntry entry;
+    if (nValue >= 0)
+        entry.coin = Coin(CTxOut(nValue, CScript() << OP_TRUE), 1, false);
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    mapCoins[outpoint] = std::move(entry);
+}
+
+//! Everything LoadBlockIndexSnapshot restores for an entry
+std::map<uint256, std::string> DescribeBlockIndex()
+{
+    std::map<uint256, std::string> mapDesc;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex) {
+        const CBlockIndex* pindex = item.second;
+        mapDesc[item.first] = strprintf("%d %u %d %u %u %u %s %s %s", pindex->nHeight, pindex->nStatus, pindex->nFile,
+            pindex->nDataPos, pindex->nUndoPos, pindex->nTx, pindex->nChainWork.GetHex(),
+            pindex->pprev ? pindex->pprev->GetBlockHash().ToString() : "",
+            pindex->pskip ? pindex->pskip->GetBlockHash().ToString() : "");
+    }
+    return mapDesc;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(txdb_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(coins_frozen_batch_reads)
+{
+    CCoinsViewDBTest coinsdb;
+    COutPoint spent(GetRandHash(), 0);
+    COutPoint changed(GetRandHash(), 1);
+    COutPoint untouched(GetRandHash(), 2);
+    COutPoint added(GetRandHash(), 3);
+
+    // Commit the initial state synchronously
+    CCoinsMap mapCoins;
+    AddDirty(mapCoins, spent, 10);
+    AddDirty(mapCoins, changed, 20);
+    AddDirty(mapCoins, untouched, 30);
+    uint256 hashFirst = GetRandHash();
+    BOOST_CHECK(coinsdb.BatchWrite(mapCoins, hashFirst));
+    BOOST_CHECK(coinsdb.WaitForWrite());
+    BOOST_CHECK(coinsdb.GetBestBlock() == hashFirst);
+
+    // Freeze a batch that hasn't reached the database yet
+    AddDirty(mapCoins, spent, -1);
+    AddDirty(mapCoins, changed, 21);
+    AddDirty(mapCoins, added, 40);
+    uint256 hashSecond = GetRandHash();
+    coinsdb.Freeze(mapCoins, hashSecond);
+
+    // Reads are served from the frozen batch first, then from the database
+    for (int i = 0; i < 2; i++) {
+        Coin coin;
+        BOOST_CHECK(!coinsdb.GetCoin(spent, coin));
+        BOOST_CHECK(!coinsdb.HaveCoin(spent));
+        BOOST_CHECK(coinsdb.GetCoin(changed, coin));
+        BOOST_CHECK_EQUAL(coin.out.nValue, 21);
+        BOOST_CHECK(coinsdb.GetCoin(untouched, coin));
+        BOOST_CHECK_EQUAL(coin.out.nValue, 30);
+        BOOST_CHECK(coinsdb.HaveCoin(added));
+        BOOST_CHECK(coinsdb.GetBestBlock() == hashSecond);
+
+        // Once written the database gives the same answers
+        if (i == 0) {
+            BOOST_CHECK(coinsdb.HasFrozen());
+            coinsdb.WriteFrozen();
+            BOOST_CHECK(!coinsdb.HasFrozen());
+        }
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(block_index_snapshot, TestChain100Setup)
+{
+    LOCK(cs_main);
+    FlushStateToDisk();
+    std::map<uint256, std::string> mapExpected = DescribeBlockIndex();
+    std::vector<std::pair<int, CBlockIndex*> > vSortedByHeight;
+
+    // Round trip
+    BOOST_CHECK(DumpBlockIndexSnapshot());
+    UnloadBlockIndex();
+    BOOST_CHECK(LoadBlockIndexSnapshot(vSortedByHeight));
+    BOOST_CHECK_EQUAL(vSortedByHeight.size(), mapExpected.size());
+    BOOST_CHECK(DescribeBlockIndex() == mapExpected);
+
+    // A snapshot is only used once
+    UnloadBlockIndex();
+    vSortedByHeight.clear();
+    BOOST_CHECK(!LoadBlockIndexSnapshot(vSortedByHeight));
+    BOOST_CHECK(mapBlockIndex.empty());
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK(DescribeBlockIndex() == mapExpected);
+
+    // Changes behind the snapshot's back make it stale: a new block file info...
+    int nLastFile;
+    CBlockFileInfo info;
+    BOOST_CHECK(pblocktree->ReadLastBlockFile(nLastFile));
+    BOOST_CHECK(pblocktree->ReadBlockFileInfo(nLastFile, info));
+    BOOST_CHECK(DumpBlockIndexSnapshot());
+    info.nBlocks++;
+    std::vector<std::pair<int, const CBlockFileInfo*> > vFiles(1, std::make_pair(nLastFile, &info));
+    BOOST_CHECK(pblocktree->WriteBatchSync(vFiles, nLastFile, std::vector<const CBlockIndex*>()));
+    UnloadBlockIndex();
+    BOOST_CHECK(!LoadBlockIndexSnapshot(vSortedByHeight));
+    BOOST_CHECK(mapBlockIndex.empty());
+    BOOST_CHECK(LoadBlockIndex());
+
+    // ...or a changed entry for the best block
+    BOOST_CHECK(DumpBlockIndexSnapshot());
+    CBlockIndex indexTip = *chainActive.Tip();
+    unsigned int nUndoPos = indexTip.nUndoPos;
+    indexTip.nUndoPos++;
+    std::vector<const CBlockIndex*> vBlocks(1, &indexTip);
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), nLastFile, vBlocks));
+    UnloadBlockIndex();
+    BOOST_CHECK(!LoadBlockIndexSnapshot(vSortedByHeight));
+    BOOST_CHECK(mapBlockIndex.empty());
+    BOOST_CHECK(LoadBlockIndex());
+    BOOST_CHECK_EQUAL(chainActive.Tip()->nUndoPos, nUndoPos + 1);
+
+    // Put the tip back for the teardown
+    indexTip = *chainActive.Tip();
+    indexTip.nUndoPos = nUndoPos;
+    BOOST_CHECK(pblocktree->WriteBatchSync(std::vector<std::pair<int, const CBlockFileInfo*> >(), nLastFile, vBlocks));
+}
+
+BOOST_AUTO_TEST_CASE(index_updates_queue)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    uint256 hashBest;
+    BOOST_CHECK(!blocktree.ReadIndexBestBlock(hashBest));
+
+    // Queue a few blocks worth of txindex and spent index entries
+    std::vector<uint256> vTxid;
+    std::vector<uint256> vBlock;
+    for (int i = 0; i < 10; i++) {
+        CIndexUpdates updates;
+        updates.hashBestBlock = GetRandHash();
+        uint256 txid = GetRandHash();
+        updates.vTxIndex.push_back(std::make_pair(txid, CDiskTxPos(CDiskBlockPos(i, 8), 81)));
+        updates.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(txid, 0), CSpentIndexValue(txid, 0, i, 1000, 1, uint160())));
+        vTxid.push_back(txid);
+        vBlock.push_back(updates.hashBestBlock);
+        BOOST_CHECK(blocktree.QueueIndexUpdates(std::move(updates)));
+    }
+
+    // Reads see everything queued before them
+    for (int i = 0; i < 10; i++) {
+        CDiskTxPos pos;
+        BOOST_CHECK(blocktree.ReadTxIndex(vTxid[i], pos));
+        BOOST_CHECK_EQUAL(pos.nFile, i);
+        BOOST_CHECK_EQUAL(pos.nTxOffset, 81U);
+    }
+    BOOST_CHECK(blocktree.ReadIndexBestBlock(hashBest));
+    BOOST_CHECK(hashBest == vBlock.back());
+
+    // Undo the last block
+    CIndexUpdates undo;
+    undo.hashBestBlock = vBlock[8];
+    undo.fErase = true;
+    undo.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(vTxid[9], 0), CSpentIndexValue()));
+    BOOST_CHECK(blocktree.QueueIndexUpdates(std::move(undo)));
+    BOOST_CHECK(blocktree.SyncIndexUpdates());
+
+    CSpentIndexKey key(vTxid[9], 0);
+    CSpentIndexValue value;
+    BOOST_CHECK(!blocktree.ReadSpentIndex(key, value));
+    key = CSpentIndexKey(vTxid[8], 0);
+    BOOST_CHECK(blocktree.ReadSpentIndex(key, value));
+    BOOST_CHECK_EQUAL(value.blockHeight, 8);
+    BOOST_CHECK(blocktree.ReadIndexBestBlock(hashBest));
+    BOOST_CHECK(hashBest == vBlock[8]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_digitalcoin.h"
 #include "utiltime.h"
@@ -83,4 +84,119 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static void SignSpend(CMutableTransaction& spend, const CKey& key, const CScript& scriptPubKey)
+{
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig = CScript() << vchSig;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_preverify_scripts, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+
+    // A signature for something else fails for good, and does not stop the
+    // real one from being accepted afterwards
+    CMutableTransaction badSpend(spend);
+    badSpend.vout[0].nValue = 12*CENT;
+    badSpend.vin[0].scriptSig << vchSig;
+    CValidationState state;
+    int nDoS = 0;
+    BOOST_CHECK(!PreVerifyTransactionScripts(mempool, MakeTransactionRef(badSpend), state));
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+    BOOST_CHECK_EQUAL(state.GetRejectReason().find("mandatory-script-verify-flag-failed"), 0);
+
+    // The signature is verified once, accepting the transaction then finds
+    // it in the cache
+    spend.vin[0].scriptSig << vchSig;
+    uint64_t nHits = GetSignatureCacheHits();
+    state = CValidationState();
+    BOOST_CHECK(PreVerifyTransactionScripts(mempool, MakeTransactionRef(spend), state));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK_EQUAL(GetSignatureCacheHits(), nHits);
+    BOOST_CHECK(ToMemPool(spend));
+    BOOST_CHECK(GetSignatureCacheHits() > nHits);
+
+    // Already in the mempool, and its coin is gone for anyone else, which
+    // is not final and left to AcceptToMemoryPool
+    BOOST_CHECK(!PreVerifyTransactionScripts(mempool, MakeTransactionRef(spend), state));
+    BOOST_CHECK(state.IsValid());
+
+    // Correctly signed, but a double spend of the mempool transaction, so
+    // its scripts are not verified
+    CMutableTransaction doubleSpend(spend);
+    doubleSpend.vout[0].nValue = 10*CENT;
+    SignSpend(doubleSpend, coinbaseKey, scriptPubKey);
+    BOOST_CHECK(!PreVerifyTransactionScripts(mempool, MakeTransactionRef(doubleSpend), state));
+    BOOST_CHECK(state.IsValid());
+    mempool.clear();
+    BOOST_CHECK(PreVerifyTransactionScripts(mempool, MakeTransactionRef(doubleSpend), state));
+
+    // Neither are the scripts of a transaction paying no fee
+    CMutableTransaction freeSpend(spend);
+    freeSpend.vin[0].prevout.hash = coinbaseTxns[1].GetHash();
+    freeSpend.vout[0].nValue = coinbaseTxns[1].vout[0].nValue;
+    SignSpend(freeSpend, coinbaseKey, scriptPubKey);
+    BOOST_CHECK(!PreVerifyTransactionScripts(mempool, MakeTransactionRef(freeSpend), state));
+    BOOST_CHECK(state.IsValid());
+}
+
+static std::vector<CScriptCheck> MakeScriptChecks(const CTransaction& tx, const CScript& scriptPubKey)
+{
+    std::vector<CScriptCheck> vChecks;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        vChecks.push_back(CScriptCheck(scriptPubKey, 0, tx, i, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC, false));
+    return vChecks;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_run_script_checks, TestingSetup)
+{
+    // A batch like the scriptSigs PrivateSend clients send for the final
+    // transaction, each input signed on its own and checked without cs_main
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction tx;
+    tx.vin.resize(4);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        tx.vin[i].prevout = COutPoint(GetRandHash(), i);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 11*CENT;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, tx, i, SIGHASH_ALL);
+        BOOST_CHECK(key.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        tx.vin[i].scriptSig = CScript() << vchSig;
+    }
+
+    const CTransaction txValid(tx);
+    std::vector<CScriptCheck> vChecks = MakeScriptChecks(txValid, scriptPubKey);
+    BOOST_CHECK(RunScriptChecks(vChecks));
+
+    // A signature made for another input rejects the whole batch
+    tx.vin[2].scriptSig = tx.vin[1].scriptSig;
+    const CTransaction txBad(tx);
+    vChecks = MakeScriptChecks(txBad, scriptPubKey);
+    BOOST_CHECK(!RunScriptChecks(vChecks));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -32,6 +32,8 @@ static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_INDEX_SNAPSHOT = 'S';
+static const char DB_INDEX_BEST_BLOCK = 'I';
 
 namespace {
 
@@ -57,19 +59,45 @@ struct CoinEntry {
 
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true), fWriteFailed(false), nWriteSequence(0)
 {
 }
 
+CCoinsViewDB::~CCoinsViewDB()
+{
+    WaitForWrite();
+}
+
 bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        CCoinsMap::const_iterator it;
+        if (pcoinsFrozen && (it = pcoinsFrozen->find(outpoint)) != pcoinsFrozen->end()) {
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
     return db.Read(CoinEntry(&outpoint), coin);
 }
 
 bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        CCoinsMap::const_iterator it;
+        if (pcoinsFrozen && (it = pcoinsFrozen->find(outpoint)) != pcoinsFrozen->end())
+            return !it->second.coin.IsSpent();
+    }
     return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        if (!hashBlockFrozen.IsNull())
+            return hashBlockFrozen;
+    }
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
@@ -77,28 +105,72 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
-    CDBBatch batch(db);
-    size_t count = 0;
-    size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
-        if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            CoinEntry entry(&it->first);
-            if (it->second.coin.IsSpent())
-                batch.Erase(entry);
-            else
-                batch.Write(entry, it->second.coin);
-            changed++;
+    // Keep one write in flight so batches reach the database in order
+    boost::lock_guard<boost::mutex> lockWriter(cs_writer);
+    if (threadWriter.joinable())
+        threadWriter.join();
+    if (fWriteFailed)
+        return false;
+
+    // Take over the caller's entries without copying them and let the
+    // validation thread go on while the writer thread commits them.
+    std::unique_ptr<CCoinsMap> pcoins(new CCoinsMap(std::move(mapCoins)));
+    mapCoins.clear();
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        pcoinsFrozen.swap(pcoins);
+        hashBlockFrozen = hashBlock;
+    }
+    nWriteSequence++;
+    threadWriter = boost::thread(boost::bind(&CCoinsViewDB::WriteFrozen, this));
+    return true;
+}
+
+void CCoinsViewDB::WriteFrozen() {
+    RenameThread("digitalcoin-coinsdb");
+    try {
+        CDBBatch batch(db);
+        size_t count = 0;
+        size_t changed = 0;
+        for (CCoinsMap::const_iterator it = pcoinsFrozen->begin(); it != pcoinsFrozen->end(); it++) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                CoinEntry entry(&it->first);
+                if (it->second.coin.IsSpent())
+                    batch.Erase(entry);
+                else
+                    batch.Write(entry, it->second.coin);
+                changed++;
+            }
+            count++;
         }
-        count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        if (!hashBlockFrozen.IsNull())
+            batch.Write(DB_BEST_BLOCK, hashBlockFrozen);
+
+        if (!db.WriteBatch(batch)) {
+            fWriteFailed = true;
+            return;
+        }
+        LogPrint("coindb", "Committed %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        fWriteFailed = true;
+        return;
     }
-    if (!hashBlock.IsNull())
-        batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    bool ret = db.WriteBatch(batch);
-    LogPrint("coindb", "Committed %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return ret;
+    // Release the frozen entries outside of the lock
+    std::unique_ptr<CCoinsMap> pcoinsWritten;
+    {
+        boost::lock_guard<boost::mutex> lock(cs_frozen);
+        pcoinsWritten.swap(pcoinsFrozen);
+        hashBlockFrozen.SetNull();
+    }
+}
+
+bool CCoinsViewDB::WaitForWrite() const {
+    boost::lock_guard<boost::mutex> lockWriter(cs_writer);
+    if (threadWriter.joinable())
+        threadWriter.join();
+    return !fWriteFailed;
 }
 
 size_t CCoinsViewDB::EstimateSize() const
@@ -106,7 +178,117 @@ size_t CCoinsViewDB::EstimateSize() const
     return db.EstimateSize(DB_COIN, (char)(DB_COIN+1));
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe),
+    fIndexWriting(false), fIndexWriteFailed(false), fStopIndexWriter(false) {
+}
+
+CBlockTreeDB::~CBlockTreeDB() {
+    {
+        boost::unique_lock<boost::mutex> lock(cs_indexQueue);
+        fStopIndexWriter = true;
+        condIndexQueue.notify_all();
+    }
+    // The writer finishes what is queued before it stops
+    if (threadIndexWriter.joinable())
+        threadIndexWriter.join();
+}
+
+bool CBlockTreeDB::QueueIndexUpdates(CIndexUpdates&& updates) {
+    boost::unique_lock<boost::mutex> lock(cs_indexQueue);
+    // Don't let the writer fall behind without bound, e.g. during initial sync
+    while (vIndexQueue.size() >= MAX_QUEUED_INDEX_UPDATES && !fIndexWriteFailed)
+        condIndexWritten.wait(lock);
+    if (fIndexWriteFailed)
+        return false;
+    vIndexQueue.push_back(std::move(updates));
+    if (!threadIndexWriter.joinable())
+        threadIndexWriter = boost::thread(boost::bind(&CBlockTreeDB::ThreadIndexWriter, this));
+    condIndexQueue.notify_all();
+    return true;
+}
+
+bool CBlockTreeDB::SyncIndexUpdates() {
+    boost::unique_lock<boost::mutex> lock(cs_indexQueue);
+    while ((!vIndexQueue.empty() || fIndexWriting) && !fIndexWriteFailed)
+        condIndexWritten.wait(lock);
+    return !fIndexWriteFailed;
+}
+
+bool CBlockTreeDB::ReadIndexBestBlock(uint256 &hash) {
+    return Read(DB_INDEX_BEST_BLOCK, hash);
+}
+
+void CBlockTreeDB::ThreadIndexWriter() {
+    RenameThread("digitalcoin-indexdb");
+    while (true) {
+        std::vector<CIndexUpdates> vUpdates;
+        {
+            boost::unique_lock<boost::mutex> lock(cs_indexQueue);
+            while (vIndexQueue.empty() && !fStopIndexWriter)
+                condIndexQueue.wait(lock);
+            if (vIndexQueue.empty())
+                return;
+            vUpdates.swap(vIndexQueue);
+            fIndexWriting = true;
+            condIndexWritten.notify_all();
+        }
+
+        bool fWritten = WriteIndexUpdates(vUpdates);
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs_indexQueue);
+            fIndexWriting = false;
+            if (!fWritten)
+                fIndexWriteFailed = true;
+            condIndexWritten.notify_all();
+            if (fIndexWriteFailed)
+                return;
+        }
+    }
+}
+
+bool CBlockTreeDB::WriteIndexUpdates(const std::vector<CIndexUpdates>& vUpdates) {
+    try {
+        CDBBatch batch(*this);
+        size_t nEntries = 0;
+        BOOST_FOREACH(const CIndexUpdates& updates, vUpdates) {
+            for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=updates.vTxIndex.begin(); it!=updates.vTxIndex.end(); it++)
+                batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
+            for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=updates.vAddressIndex.begin(); it!=updates.vAddressIndex.end(); it++) {
+                if (updates.fErase) {
+                    batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+                } else {
+                    batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+                }
+            }
+            for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=updates.vAddressUnspentIndex.begin(); it!=updates.vAddressUnspentIndex.end(); it++) {
+                if (it->second.IsNull()) {
+                    batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
+                } else {
+                    batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
+                }
+            }
+            for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=updates.vSpentIndex.begin(); it!=updates.vSpentIndex.end(); it++) {
+                if (it->second.IsNull()) {
+                    batch.Erase(make_pair(DB_SPENTINDEX, it->first));
+                } else {
+                    batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
+                }
+            }
+            for (std::vector<CTimestampIndexKey>::const_iterator it=updates.vTimestampIndex.begin(); it!=updates.vTimestampIndex.end(); it++)
+                batch.Write(make_pair(DB_TIMESTAMPINDEX, *it), 0);
+            nEntries += updates.vTxIndex.size() + updates.vAddressIndex.size() + updates.vAddressUnspentIndex.size() + updates.vSpentIndex.size() + updates.vTimestampIndex.size();
+        }
+        // Written in the same batch, so it always matches what is on disk
+        batch.Write(DB_INDEX_BEST_BLOCK, vUpdates.back().hashBestBlock);
+        if (!WriteBatch(batch))
+            return false;
+        LogPrint("index", "Committed %u index entries for %u blocks up to %s\n", (unsigned int)nEntries, (unsigned int)vUpdates.size(), vUpdates.back().hashBestBlock.ToString());
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        return false;
+    }
+    return true;
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -131,6 +313,8 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 
 CCoinsViewCursor *CCoinsViewDB::Cursor() const
 {
+    // The cursor reads the database directly, make sure it is up to date
+    WaitForWrite();
     CCoinsViewDBCursor *i = new CCoinsViewDBCursor(const_cast<CDBWrapper*>(&db)->NewIterator(), GetBestBlock());
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
@@ -196,47 +380,20 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
 }
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
+    SyncIndexUpdates();
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
-}
-
 bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+    SyncIndexUpdates();
     return Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
-        if (it->second.IsNull()) {
-            batch.Erase(make_pair(DB_SPENTINDEX, it->first));
-        } else {
-            batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
-        }
-    }
-    return WriteBatch(batch);
-}
-
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
-        if (it->second.IsNull()) {
-            batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
-        } else {
-            batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
-        }
-    }
-    return WriteBatch(batch);
-}
-
 bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
                                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
 
+    SyncIndexUpdates();
+
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
@@ -260,24 +417,12 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
-}
-
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CDBBatch batch(*this);
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
-}
-
 bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
                                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                                     int start, int end) {
 
+    SyncIndexUpdates();
+
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     if (start > 0 && end > 0) {
@@ -308,14 +453,10 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
-    CDBBatch batch(*this);
-    batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
-    return WriteBatch(batch);
-}
-
 bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes) {
 
+    SyncIndexUpdates();
+
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
     pcursor->Seek(make_pair(DB_TIMESTAMPINDEX, CTimestampIndexIteratorKey(low)));
@@ -346,6 +487,40 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+bool CBlockTreeDB::WriteIndexSnapshotId(const uint256 &id) {
+    return Write(DB_INDEX_SNAPSHOT, id, true);
+}
+
+bool CBlockTreeDB::ReadIndexSnapshotId(uint256 &id) {
+    return Read(DB_INDEX_SNAPSHOT, id);
+}
+
+bool CBlockTreeDB::EraseIndexSnapshotId() {
+    return Erase(DB_INDEX_SNAPSHOT, true);
+}
+
+bool CBlockTreeDB::ReadBlockIndex(const uint256 &hash, CDiskBlockIndex &diskindex) {
+    return Read(make_pair(DB_BLOCK_INDEX, hash), diskindex);
+}
+
+CBlockIndex* InsertDiskBlockIndex(const CDiskBlockIndex& diskindex, boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
+    pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+    pindexNew->nHeight        = diskindex.nHeight;
+    pindexNew->nFile          = diskindex.nFile;
+    pindexNew->nDataPos       = diskindex.nDataPos;
+    pindexNew->nUndoPos       = diskindex.nUndoPos;
+    pindexNew->nVersion       = diskindex.nVersion;
+    pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+    pindexNew->nTime          = diskindex.nTime;
+    pindexNew->nBits          = diskindex.nBits;
+    pindexNew->nNonce         = diskindex.nNonce;
+    pindexNew->nStatus        = diskindex.nStatus;
+    pindexNew->nTx            = diskindex.nTx;
+    return pindexNew;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
@@ -360,19 +535,7 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
             CDiskBlockIndex diskindex;
             if (pcursor->GetValue(diskindex)) {
                 // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
+                CBlockIndex* pindexNew = InsertDiskBlockIndex(diskindex, insertBlockIndex);
 
                 //LogPrintf("Block : %s \n",pindexNew->ToString());//DGCLOG
                 if (!pindexNew->CheckIndex(Params().GetConsensus()))
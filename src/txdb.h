@@ -11,12 +11,16 @@
 #include "chain.h"
 #include "spentindex.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -40,6 +44,8 @@ static const int64_t nMaxBlockDBCache = 2;
 static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
 //! Max memory allocated to coin DB specific cache (MiB)
 static const int64_t nMaxCoinsDBCache = 8;
+//! Max number of blocks whose index updates can wait for the index writer
+static const unsigned int MAX_QUEUED_INDEX_UPDATES = 200;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -71,8 +77,28 @@ class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+
+    /**
+     * Coins handed to BatchWrite that the writer thread hasn't committed yet.
+     * They are frozen while the write runs and are the most recent state for
+     * their outpoints, so reads look here before going to the database.
+     * Only the writer thread clears them, under cs_frozen.
+     */
+    mutable boost::mutex cs_frozen;
+    std::unique_ptr<CCoinsMap> pcoinsFrozen;
+    uint256 hashBlockFrozen;
+    //! Guards starting and joining threadWriter, which can be waited on from RPC threads
+    mutable boost::mutex cs_writer;
+    mutable boost::thread threadWriter;
+    bool fWriteFailed;
+    //! Number of BatchWrite calls so far, see GetWriteSequence()
+    std::atomic<uint64_t> nWriteSequence;
+
+    void WriteFrozen();
+
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
@@ -80,6 +106,16 @@ public:
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) override;
     CCoinsViewCursor *Cursor() const override;
 
+    //! Wait until the last BatchWrite reached the database. Returns false if writing it failed.
+    bool WaitForWrite() const;
+
+    /**
+     * Changes whenever BatchWrite is called. Coins read on other threads
+     * after this returned a given value are still current as long as it
+     * keeps returning that value.
+     */
+    uint64_t GetWriteSequence() const { return nWriteSequence; }
+
     //! Attempt to update from an older database format. Returns whether an error occurred.
     bool Upgrade();
     size_t EstimateSize() const override;
@@ -107,37 +143,81 @@ private:
     friend class CCoinsViewDB;
 };
 
+/** Changes to the optional indexes (-txindex, -addressindex, -spentindex, -timestampindex) for one block */
+struct CIndexUpdates
+{
+    //! The block the indexes are up to date with once these changes are written
+    uint256 hashBestBlock;
+    //! Set when disconnecting a block: address index entries are erased rather than written
+    bool fErase;
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;
+    std::vector<CTimestampIndexKey> vTimestampIndex;
+
+    CIndexUpdates() : fErase(false) {}
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CDBWrapper
 {
 public:
     CBlockTreeDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CBlockTreeDB();
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    /**
+     * Index updates queued by QueueIndexUpdates, in connect/disconnect
+     * order. The writer thread takes everything queued at once and writes
+     * it as a single batch, together with the block it brings the indexes
+     * up to.
+     */
+    boost::mutex cs_indexQueue;
+    boost::condition_variable condIndexQueue;
+    boost::condition_variable condIndexWritten;
+    std::vector<CIndexUpdates> vIndexQueue;
+    bool fIndexWriting;
+    bool fIndexWriteFailed;
+    bool fStopIndexWriter;
+    boost::thread threadIndexWriter;
+
+    void ThreadIndexWriter();
+    bool WriteIndexUpdates(const std::vector<CIndexUpdates>& vUpdates);
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
+    //! Hand a block's index changes to the writer thread. Returns false if an earlier write failed.
+    bool QueueIndexUpdates(CIndexUpdates&& updates);
+    //! Wait until all queued index changes are written. Returns false if writing them failed.
+    bool SyncIndexUpdates();
+    //! The block the indexes on disk are up to date with
+    bool ReadIndexBestBlock(uint256 &hash);
+    // The readers wait for queued changes, so they always see everything queued before
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
-    bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
-    bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
-    bool WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
-    bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
                           int start = 0, int end = 0);
-    bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &vect);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool ReadBlockIndex(const uint256 &hash, CDiskBlockIndex &diskindex);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    //! Identifies the block index snapshot file written for the current state of the database
+    bool WriteIndexSnapshotId(const uint256 &id);
+    bool ReadIndexSnapshotId(uint256 &id);
+    bool EraseIndexSnapshotId();
 };
 
+/** Fill in the block index entry for a stored one, inserting it and its parent as needed */
+CBlockIndex* InsertDiskBlockIndex(const CDiskBlockIndex& diskindex, boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+
 #endif // BITCOIN_TXDB_H
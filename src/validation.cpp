@@ -11,9 +11,11 @@
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "compressor.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
 #include "policy/policy.h"
@@ -39,6 +41,7 @@
 #include "instantx.h"
 #include "masternodeman.h"
 #include "masternode-payments.h"
+#include "memusage.h"
 
 #include <sstream>
 
@@ -70,6 +73,7 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fCompressBlocks = DEFAULT_COMPRESS_BLOCKS;
 bool fAddressIndex = false;
 bool fTimestampIndex = false;
 bool fSpentIndex = false;
@@ -87,6 +91,7 @@ bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
 
 std::atomic<bool> fDIP0001WasLockedIn{false};
 std::atomic<bool> fDIP0001ActiveAtTip{false};
+std::atomic<bool> fMempoolLoaded{false};
 
 uint256 hashAssumeValid;
 
@@ -137,6 +142,13 @@ namespace {
 
     CBlockIndex *pindexBestInvalid;
 
+    /** Owns the entries of mapBlockIndex. */
+    CBlockIndexArena arenaBlockIndex;
+    /** Taken by LookupBlockIndex, and exclusively (under cs_main) to change mapBlockIndex. */
+    boost::shared_mutex cs_mapBlockIndex;
+    /** chainActive.Tip(), published on every change for GetChainView. */
+    std::atomic<CBlockIndex*> pindexChainView(NULL);
+
     /**
      * The set of all CBlockIndex entries with BLOCK_VALID_TRANSACTIONS (for itself and all ancestors) and
      * as good as our current tip or better. Entries may be failed, though, and pruning nodes may be
@@ -554,10 +566,11 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransactionRef& ptx, bool fLimitFree,
                               bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
-                              std::vector<COutPoint>& coins_to_uncache, bool fDryRun)
+                              int64_t nAcceptTime, std::vector<COutPoint>& coins_to_uncache, bool fDryRun)
 {
+    const CTransaction& tx = *ptx;
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
@@ -594,7 +607,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-in-mempool");
 
     // If this is a Transaction Lock Request check to see if it's valid
-    if(instantsend.HasTxLockRequest(hash) && !CTxLockRequest(tx).IsValid())
+    if(instantsend.HasTxLockRequest(hash) && !CTxLockRequest(ptx).IsValid())
         return state.DoS(10, error("AcceptToMemoryPool : CTxLockRequest %s is invalid", hash.ToString()),
                             REJECT_INVALID, "bad-txlockrequest");
 
@@ -745,7 +758,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+        CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -846,20 +859,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                 // Save these to avoid repeated lookups
                 setIterConflicting.insert(mi);
 
-                // If this entry is "dirty", then we don't have descendant
-                // state for this transaction, which means we probably have
-                // lots of in-mempool descendants.
-                // Don't allow replacements of dirty transactions, to ensure
-                // that we don't spend too much time walking descendants.
-                // This should be rare.
-                if (mi->IsDirty()) {
-                    return state.DoS(0,
-                            error("AcceptToMemoryPool: rejecting replacement %s; cannot replace tx %s with untracked descendants",
-                                hash.ToString(),
-                                mi->GetTx().GetHash().ToString()),
-                            REJECT_NONSTANDARD, "too many potential replacements");
-                }
-
                 // Don't allow the replacement to reduce the feerate of the
                 // mempool.
                 //
@@ -963,7 +962,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        PrecomputedTransactionData txdata(tx);
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata))
             return false;
 
         // Check again against just the consensus-critical mandatory script
@@ -975,7 +975,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata))
         {
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
                 __func__, hash.ToString(), FormatStateMessage(state));
@@ -1014,18 +1014,18 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
     }
 
     if(!fDryRun)
-        GetMainSignals().SyncTransaction(tx, NULL);
+        GetMainSignals().SyncTransaction(ptx, NULL);
 
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
 {
     std::vector<COutPoint> coins_to_uncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, coins_to_uncache, fDryRun);
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, nAcceptTime, coins_to_uncache, fDryRun);
     if (!res || fDryRun) {
-        if(!res) LogPrint("mempool", "%s: %s %s\n", __func__, tx.GetHash().ToString(), state.GetRejectReason());
+        if(!res) LogPrint("mempool", "%s: %s %s\n", __func__, tx->GetHash().ToString(), state.GetRejectReason());
         BOOST_FOREACH(const COutPoint& hashTx, coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
     }
@@ -1035,6 +1035,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, fRejectAbsurdFee, fDryRun);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee, bool fDryRun)
+{
+    return AcceptToMemoryPool(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, fOverrideMempoolLimit, fRejectAbsurdFee, fDryRun);
+}
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes)
 {
     if (!fTimestampIndex)
@@ -1089,8 +1101,6 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
 {
     CBlockIndex *pindexSlow = NULL;
 
-    LOCK(cs_main);
-
     if (mempool.lookup(hash, txOut))
     {
         return true;
@@ -1104,6 +1114,23 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
                 return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
             try {
+                // nTxOffset only applies to blocks stored in the network format
+                uint32_t nMarker;
+                file >> nMarker;
+                if (nMarker == COMPRESSED_BLOCK_MARKER) {
+                    CBlock block;
+                    if (!ReadBlockFromDisk(block, postx, consensusParams))
+                        return false;
+                    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+                        if (tx->GetHash() == hash) {
+                            txOut = *tx;
+                            hashBlock = block.GetHash();
+                            return true;
+                        }
+                    }
+                    return error("%s: txid not found in compressed block", __func__);
+                }
+                fseek(file.Get(), -(long)sizeof(nMarker), SEEK_CUR);
                 file >> header;
                 fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
                 file >> txOut;
@@ -1120,6 +1147,10 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
         return false;
     }
 
+    // Only the coin database lookup needs cs_main, the mempool and txindex
+    // paths above are safe without it
+    LOCK(cs_main);
+
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         const Coin& coin = AccessByTxid(*pcoinsTip, hash);
         if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
@@ -1128,9 +1159,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
+            BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+                if (tx->GetHash() == hash) {
+                    txOut = *tx;
                     hashBlock = pindexSlow->GetBlockHash();
                     return true;
                 }
@@ -1158,8 +1189,13 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     if (fileout.IsNull())
         return error("WriteBlockToDisk: OpenBlockFile failed");
 
+    // A block whose version equals the marker is always compressed, so that
+    // records in the network format never start with it
+    bool fCompress = fCompressBlocks || (uint32_t)block.nVersion == COMPRESSED_BLOCK_MARKER;
+    CBlockCompressor blockOut(const_cast<CBlock&>(block), fCompress);
+
     // Write index header
-    unsigned int nSize = fileout.GetSerializeSize(block);
+    unsigned int nSize = fileout.GetSerializeSize(blockOut);
     fileout << FLATDATA(messageStart) << nSize;
 
     // Write block
@@ -1167,7 +1203,7 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     if (fileOutPos < 0)
         return error("WriteBlockToDisk: ftell failed");
     pos.nPos = (unsigned int)fileOutPos;
-    fileout << block;
+    fileout << blockOut;
 
     return true;
 }
@@ -1183,7 +1219,8 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 
     // Read block
     try {
-        filein >> block;
+        CBlockCompressor blockIn(block);
+        filein >> blockIn;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1208,6 +1245,50 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    // The block is preceded by the message start and its size, see WriteBlockToDisk
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: invalid block position %s", __func__, pos.ToString());
+    CDiskBlockPos hpos = pos;
+    hpos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE))
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_SIZE)
+            return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+
+        vchBlock.resize(nSize);
+        filein.read((char*)vchBlock.data(), nSize);
+
+        // Compressed records are expanded to the network format
+        if (nSize >= sizeof(COMPRESSED_BLOCK_MARKER) && ReadLE32(vchBlock.data()) == COMPRESSED_BLOCK_MARKER) {
+            CBlock block;
+            CBlockCompressor blockIn(block);
+            CDataStream ssCompressed(vchBlock, SER_DISK, CLIENT_VERSION);
+            ssCompressed >> blockIn;
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock.reserve(ssCompressed.size() * 2);
+            ssBlock << block;
+            vchBlock.assign(ssBlock.begin(), ssBlock.end());
+        }
+    }
+    catch (const std::exception& e) {
+        return error("%s: Read from block file failed: %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 double ConvertBitsToDouble(unsigned int nBits)
 {
     int nShift = (nBits >> 24) & 0xff;
@@ -1469,7 +1550,10 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (txdata) {
+        if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, *txdata), &error))
+            return false;
+    } else if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
         return false;
     }
     return true;
@@ -1528,7 +1612,7 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, const PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -1562,7 +1646,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                 const CAmount amount = coin.out.nValue;
 
                 // Verify signature
-                CScriptCheck check(scriptPubKey, amount, tx, i, flags, cacheStore);
+                CScriptCheck check(scriptPubKey, amount, tx, i, flags, cacheStore, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -1575,7 +1659,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(scriptPubKey, amount, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -1708,8 +1792,9 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 }
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
- *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state. */
-static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view)
+ *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
+ *  If fJustCheck is set, the optional indexes are left alone. */
+static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck = false)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1737,7 +1822,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
         bool is_coinbase = tx.IsCoinBase();
 
@@ -1842,13 +1927,18 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
-    if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            AbortNode(state, "Failed to delete address index");
-            return DISCONNECT_FAILED;
+    if (!fJustCheck && (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex)) {
+        CIndexUpdates updates;
+        updates.hashBestBlock = pindex->pprev->GetBlockHash();
+        updates.fErase = true;
+        if (fAddressIndex) {
+            updates.vAddressIndex.swap(addressIndex);
+            updates.vAddressUnspentIndex.swap(addressUnspentIndex);
         }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            AbortNode(state, "Failed to write address unspent index");
+        if (fSpentIndex)
+            updates.vSpentIndex.swap(spentIndex);
+        if (!pblocktree->QueueIndexUpdates(std::move(updates))) {
+            AbortNode(state, "Failed to queue index removals, the index writer has failed");
             return DISCONNECT_FAILED;
         }
     }
@@ -1888,6 +1978,340 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+// Separate from scriptcheckqueue so that relayed transactions and PrivateSend
+// signatures can be verified without cs_main while a block is being connected
+static CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+static CCriticalSection cs_mempoolcheckqueue;
+
+void ThreadMempoolScriptCheck() {
+    RenameThread("digitalcoin-mpcheck");
+    mempoolcheckqueue.Thread();
+}
+
+bool RunScriptChecks(std::vector<CScriptCheck>& vChecks)
+{
+    // Only one thread can drive the queue, anyone else verifies on its own
+    TRY_LOCK(cs_mempoolcheckqueue, lockQueue);
+    if (!nScriptCheckThreads || !lockQueue || vChecks.size() < 2) {
+        // Keep going after a failure so the rest of a batch still gets cached
+        bool fOk = true;
+        BOOST_FOREACH(CScriptCheck& check, vChecks)
+            if (!check())
+                fOk = false;
+        return fOk;
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+    control.Add(vChecks);
+    return control.Wait();
+}
+
+// Find the failing input of tx and report it the way CheckInputs does
+static bool ScriptFailureState(const CTransaction& tx, const std::vector<CTxOut>& vSpent, const PrecomputedTransactionData& txdata, CValidationState& state)
+{
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        CScriptCheck check(vSpent[i].scriptPubKey, vSpent[i].nValue, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, false, &txdata);
+        if (check())
+            continue;
+        CScriptCheck check2(vSpent[i].scriptPubKey, vSpent[i].nValue, tx, i,
+                STANDARD_SCRIPT_VERIFY_FLAGS & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, false, &txdata);
+        if (check2())
+            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+        return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+    }
+    return true;
+}
+
+static bool PreVerifyScripts(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, CValidationState* pstate)
+{
+    bool fAllOk = true;
+
+    std::vector<const CTransaction*> vCandidates;
+    vCandidates.reserve(vtx.size());
+    BOOST_FOREACH(const CTransactionRef& ptx, vtx) {
+        CValidationState state;
+        std::string reason;
+        if (ptx->IsCoinBase() || !CheckTransaction(*ptx, state) || (fRequireStandard && !IsStandardTx(*ptx, reason)))
+            fAllOk = false;
+        else
+            vCandidates.push_back(ptx.get());
+    }
+
+    // Copy the outputs being spent. An outpoint always refers to the same
+    // output, so the scripts can be checked against the copies once the
+    // locks are released; spentness is left to AcceptToMemoryPool.
+    std::vector<const CTransaction*> vVerify;
+    std::vector<std::vector<CTxOut> > vSpent;
+    vVerify.reserve(vCandidates.size());
+    vSpent.reserve(vCandidates.size());
+    {
+        LOCK2(cs_main, pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        std::unordered_map<COutPoint, CTxOut, SaltedOutpointHasher> mapBatchOutputs;
+        Coin coin;
+        BOOST_FOREACH(const CTransaction* ptx, vCandidates) {
+            const uint256& hash = ptx->GetHash();
+            if (pool.exists(hash)) {
+                fAllOk = false;
+                continue;
+            }
+            // A conflict with the mempool is rejected by AcceptToMemoryPool
+            // before it checks any signature, so don't verify it here either
+            std::vector<CTxOut> vOut;
+            vOut.reserve(ptx->vin.size());
+            BOOST_FOREACH(const CTxIn& txin, ptx->vin) {
+                if (pool.mapNextTx.count(txin.prevout))
+                    break;
+                std::unordered_map<COutPoint, CTxOut, SaltedOutpointHasher>::const_iterator it = mapBatchOutputs.find(txin.prevout);
+                if (it != mapBatchOutputs.end())
+                    vOut.push_back(it->second);
+                else if (viewMemPool.GetCoin(txin.prevout, coin) && !coin.IsSpent())
+                    vOut.push_back(coin.out);
+                else
+                    break;
+            }
+            if (vOut.size() != ptx->vin.size()) {
+                fAllOk = false;
+                continue;
+            }
+            // Same for a fee below the relay minimum, which is most likely
+            // rejected or rate limited as a free transaction
+            CAmount nValueIn = 0;
+            BOOST_FOREACH(const CTxOut& out, vOut) {
+                nValueIn += out.nValue;
+                if (!MoneyRange(nValueIn))
+                    break;
+            }
+            if (!MoneyRange(nValueIn) || nValueIn - ptx->GetValueOut() < ::minRelayTxFee.GetFee(::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION))) {
+                fAllOk = false;
+                continue;
+            }
+            for (unsigned int i = 0; i < ptx->vout.size(); i++)
+                mapBatchOutputs.emplace(COutPoint(hash, i), ptx->vout[i]);
+            vVerify.push_back(ptx);
+            vSpent.push_back(std::move(vOut));
+        }
+    }
+
+    // The checks point into vTxData, which must not reallocate
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(vVerify.size());
+    std::vector<CScriptCheck> vChecks;
+    for (size_t n = 0; n < vVerify.size(); n++) {
+        const CTransaction& tx = *vVerify[n];
+        vTxData.emplace_back(tx);
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            vChecks.push_back(CScriptCheck());
+            CScriptCheck check(vSpent[n][i].scriptPubKey, vSpent[n][i].nValue, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vTxData.back());
+            check.swap(vChecks.back());
+        }
+    }
+
+    bool fScriptsOk = RunScriptChecks(vChecks);
+
+    // The spent outputs can't change, so a script failure is final
+    if (!fScriptsOk && pstate && vVerify.size() == 1)
+        ScriptFailureState(*vVerify[0], vSpent[0], vTxData[0], *pstate);
+    return fScriptsOk && fAllOk;
+}
+
+bool PreVerifyTransactionScripts(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx)
+{
+    return PreVerifyScripts(pool, vtx, NULL);
+}
+
+bool PreVerifyTransactionScripts(CTxMemPool& pool, const CTransactionRef& ptx, CValidationState& state)
+{
+    return PreVerifyScripts(pool, std::vector<CTransactionRef>(1, ptx), &state);
+}
+
+namespace {
+
+/**
+ * Reads the blocks ActivateBestChainStep is about to connect on the prefetch
+ * threads and runs the context free checks on them, so disk reads,
+ * deserialization and PoW hashing of upcoming blocks overlap with connecting
+ * the current one instead of all happening under cs_main in ConnectTip.
+ * The coins the blocks spend are looked up in the coins database as well, so
+ * ConnectBlock doesn't have to wait on a random read for each input when the
+ * cache is cold.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CPrefetchedBlock
+    {
+        std::shared_ptr<const CBlock> pblock;
+        std::vector<std::pair<COutPoint, Coin> > vCoins;
+        //! pcoinsdbview->GetWriteSequence() before vCoins were read
+        uint64_t nCoinsWriteSequence;
+    };
+
+    //! A block to read, with its position copied under cs_main
+    struct CPrefetchRequest
+    {
+        const CBlockIndex* pindex;
+        CDiskBlockPos pos;
+        uint256 hash;
+    };
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+
+    // blocks waiting to be read, in connect order
+    std::deque<CPrefetchRequest> queue;
+    std::set<const CBlockIndex*> setInFlight;
+    std::map<const CBlockIndex*, CPrefetchedBlock> mapBlocks;
+
+    static bool PrecheckBlock(const CBlock& block)
+    {
+        // proof of work was already checked by ReadBlockFromDisk
+        bool mutated;
+        if (block.hashMerkleRoot != BlockMerkleRoot(block, &mutated) || mutated)
+            return false;
+        CValidationState state;
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+            if (!CheckTransaction(*tx, state))
+                return false;
+        return true;
+    }
+
+    /** Read the coins spent by the block that aren't created in the block itself */
+    static void ReadCoins(const CBlock& block, std::vector<std::pair<COutPoint, Coin> >& vCoins)
+    {
+        std::set<uint256> setBlockTxids;
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+            setBlockTxids.insert(tx->GetHash());
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+            if (tx->IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx->vin) {
+                if (setBlockTxids.count(txin.prevout.hash))
+                    continue;
+                Coin coin;
+                if (pcoinsdbview->GetCoin(txin.prevout, coin))
+                    vCoins.push_back(std::make_pair(txin.prevout, std::move(coin)));
+            }
+        }
+    }
+
+public:
+    /** Schedule reads for the given blocks (in connect order) and drop anything else read earlier */
+    void Prefetch(const std::vector<CBlockIndex*>& vpindex)
+    {
+        AssertLockHeld(cs_main);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::set<const CBlockIndex*> setWanted(vpindex.begin(), vpindex.end());
+        std::map<const CBlockIndex*, CPrefetchedBlock>::iterator it = mapBlocks.begin();
+        while (it != mapBlocks.end()) {
+            if (!setWanted.count(it->first))
+                mapBlocks.erase(it++);
+            else
+                ++it;
+        }
+        queue.clear();
+        BOOST_FOREACH(const CBlockIndex* pindex, vpindex) {
+            if (!mapBlocks.count(pindex) && !setInFlight.count(pindex) && (pindex->nStatus & BLOCK_HAVE_DATA)) {
+                CPrefetchRequest req = {pindex, pindex->GetBlockPos(), pindex->GetBlockHash()};
+                queue.push_back(req);
+            }
+        }
+        condWork.notify_all();
+    }
+
+    /**
+     * Get a prefetched block, waiting for it if it is being read right now.
+     * Returns NULL if it wasn't prefetched. The coins read for it are added
+     * to pcoinsTip, unless the coins database was written to since.
+     */
+    std::shared_ptr<const CBlock> Take(const CBlockIndex* pindex)
+    {
+        AssertLockHeld(cs_main);
+
+        CPrefetchedBlock prefetched;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (setInFlight.count(pindex))
+                condDone.wait(lock);
+            std::map<const CBlockIndex*, CPrefetchedBlock>::iterator it = mapBlocks.find(pindex);
+            if (it == mapBlocks.end())
+                return std::shared_ptr<const CBlock>();
+            prefetched = std::move(it->second);
+            mapBlocks.erase(it);
+        }
+
+        if (prefetched.nCoinsWriteSequence == pcoinsdbview->GetWriteSequence()) {
+            for (size_t i = 0; i < prefetched.vCoins.size(); i++)
+                pcoinsTip->CacheCoin(prefetched.vCoins[i].first, std::move(prefetched.vCoins[i].second));
+        }
+        return prefetched.pblock;
+    }
+
+    void Thread()
+    {
+        while (true) {
+            CPrefetchRequest req;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (queue.empty())
+                    condWork.wait(lock);
+                req = queue.front();
+                queue.pop_front();
+                setInFlight.insert(req.pindex);
+            }
+
+            // The index entry may change under cs_main while we read, so only
+            // what was copied into the request is used from here on.
+            CPrefetchedBlock prefetched;
+            std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+            if (ReadBlockFromDisk(*pblock, req.pos, Params().GetConsensus()) && pblock->GetHash() == req.hash) {
+                pblock->fPrechecked = PrecheckBlock(*pblock);
+                // Any coins database write after this point may make what we
+                // read stale, Take() throws the coins away if one happened.
+                prefetched.nCoinsWriteSequence = pcoinsdbview->GetWriteSequence();
+                if (pblock->fPrechecked) {
+                    try {
+                        ReadCoins(*pblock, prefetched.vCoins);
+                    } catch (const std::runtime_error& e) {
+                        // ConnectBlock will run into the same error and handle it
+                        prefetched.vCoins.clear();
+                    }
+                }
+                prefetched.pblock = pblock;
+            }
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                setInFlight.erase(req.pindex);
+                if (prefetched.pblock)
+                    mapBlocks[req.pindex] = std::move(prefetched);
+                condDone.notify_all();
+            }
+        }
+    }
+};
+
+CBlockPrefetcher blockPrefetcher;
+
+} // anon namespace
+
+void ThreadBlockPrefetch() {
+    RenameThread("digitalcoin-prefetch");
+    blockPrefetcher.Thread();
+}
+
+void PrefetchBlocks(const std::vector<CBlockIndex*>& vpindex)
+{
+    blockPrefetcher.Prefetch(vpindex);
+}
+
+std::shared_ptr<const CBlock> TakePrefetchedBlock(const CBlockIndex* pindex)
+{
+    return blockPrefetcher.Take(pindex);
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -2072,9 +2496,9 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
     fEnforceBIP30 = fEnforceBIP30 && (!pindexBIP34height || !(pindexBIP34height->GetBlockHash() == chainparams.GetConsensus().BIP34Hash));
 
     if (fEnforceBIP30) {
-        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            for (size_t o = 0; o < tx.vout.size(); o++) {
-                if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+            for (size_t o = 0; o < tx->vout.size(); o++) {
+                if (view.HaveCoin(COutPoint(tx->GetHash(), o))) {
                     return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
                                      REJECT_INVALID, "bad-txns-BIP30");
                 }
@@ -2112,6 +2536,10 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
 
     CBlockUndo blockundo;
 
+    // Shared by the script checks of each transaction, so it has to outlive the check queue control
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size());
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     std::vector<int> prevheights;
@@ -2130,7 +2558,7 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
 
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         const uint256 txhash = tx.GetHash();
 
         nInputs += tx.vin.size();
@@ -2208,9 +2636,10 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
 
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
+            txdata.push_back(fScriptChecks ? PrecomputedTransactionData(tx) : PrecomputedTransactionData());
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2272,7 +2701,7 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
         return state.DoS(0, error("ConnectBlock(DGC): %s", strError), REJECT_INVALID, "bad-cb-amount");
     }
 
-    if (!IsBlockPayeeValid(block.vtx[0], pindex->nHeight, blockReward)) {
+    if (!IsBlockPayeeValid(*block.vtx[0], pindex->nHeight, blockReward)) {
         mapRejectedBlocks.insert(make_pair(block.GetHash(), GetTime()));
         return state.DoS(0, error("ConnectBlock(DGC): couldn't find masternode or superblock payments"),
                                 REJECT_INVALID, "bad-cb-payee");
@@ -2306,28 +2735,24 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
-
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
+    // The index writer thread writes these, batched with those of the blocks around it
+    if (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex) {
+        CIndexUpdates updates;
+        updates.hashBestBlock = pindex->GetBlockHash();
+        if (fTxIndex)
+            updates.vTxIndex.swap(vPos);
+        if (fAddressIndex) {
+            updates.vAddressIndex.swap(addressIndex);
+            updates.vAddressUnspentIndex.swap(addressUnspentIndex);
         }
+        if (fSpentIndex)
+            updates.vSpentIndex.swap(spentIndex);
+        if (fTimestampIndex)
+            updates.vTimestampIndex.push_back(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash()));
+        if (!pblocktree->QueueIndexUpdates(std::move(updates)))
+            return AbortNode(state, "Failed to queue index updates, the index writer has failed");
     }
 
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if (fTimestampIndex)
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(pindex->nTime, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
-
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2337,7 +2762,7 @@ static bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockInd
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime6 = GetTimeMicros(); nTimeCallbacks += nTime6 - nTime5;
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime6 - nTime5), nTimeCallbacks * 0.000001);
@@ -2421,9 +2846,6 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
@@ -2436,8 +2858,21 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
-        if (!pcoinsTip->Flush())
+        // Unless memory is short, only push the dirty entries and keep the
+        // rest of the cache warm. The database write itself completes in the
+        // background, except on shutdown-style flushes which wait for it.
+        bool fEmptyCache = fCacheLarge || fCacheCritical;
+        if (!(fEmptyCache ? pcoinsTip->Flush() : pcoinsTip->Sync()))
             return AbortNode(state, "Failed to write to coin database");
+        // The coins must be on disk before the block files they were
+        // connected from are removed.
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinsdbview->WaitForWrite())
+            return AbortNode(state, "Failed to write to coin database");
+        // Finally remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
+        if (mode == FLUSH_STATE_ALWAYS && !pblocktree->SyncIndexUpdates())
+            return AbortNode(state, "Failed to write transaction index");
         nLastFlush = nNow;
     }
     if (fDoFullFlush || ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000)) {
@@ -2466,6 +2901,7 @@ void PruneAndFlush() {
 void static UpdateTip(CBlockIndex *pindexNew) {
     //const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    pindexChainView = pindexNew;
 
     // New best block
     mempool.AddTransactionsUpdated(1);
@@ -2547,14 +2983,14 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
         return false;
     // Resurrect mempool transactions from the disconnected block.
     std::vector<uint256> vHashUpdate;
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
+        list<CTransactionRef> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-            mempool.remove(tx, removed, true);
-        } else if (mempool.exists(tx.GetHash())) {
-            vHashUpdate.push_back(tx.GetHash());
+        if (tx->IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
+            mempool.remove(*tx, removed, true);
+        } else if (mempool.exists(tx->GetHash())) {
+            vHashUpdate.push_back(tx->GetHash());
         }
     }
     // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
@@ -2567,7 +3003,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
         GetMainSignals().SyncTransaction(tx, NULL);
     }
     return true;
@@ -2589,10 +3025,16 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    std::shared_ptr<const CBlock> pblockPrefetched;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
-            return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblockPrefetched = TakePrefetchedBlock(pindexNew);
+        if (pblockPrefetched) {
+            pblock = pblockPrefetched.get();
+        } else {
+            if (!ReadBlockFromDisk(block, pindexNew, chainparams.GetConsensus()))
+                return AbortNode(state, "Failed to read block");
+            pblock = &block;
+        }
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
@@ -2619,17 +3061,17 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
+    BOOST_FOREACH(const CTransactionRef& tx, txConflicted) {
         GetMainSignals().SyncTransaction(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+    BOOST_FOREACH(const CTransactionRef& tx, pblock->vtx) {
         GetMainSignals().SyncTransaction(tx, pblock);
     }
 
@@ -2656,6 +3098,44 @@ bool DisconnectBlocks(int blocks)
     return true;
 }
 
+bool ReplayIndexUpdates(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
+
+    if (!fTxIndex && !fAddressIndex && !fSpentIndex && !fTimestampIndex)
+        return true;
+
+    // Databases written before index updates were queued don't have the marker and are in sync
+    uint256 hashIndexed;
+    if (!pblocktree->ReadIndexBestBlock(hashIndexed))
+        return true;
+    BlockMap::iterator mi = mapBlockIndex.find(hashIndexed);
+    if (mi == mapBlockIndex.end())
+        return true;
+
+    // Index updates for blocks connected after the last index write were lost.
+    // Disconnect back to the last indexed block that is still in the chain;
+    // connecting the blocks again rewrites their index entries.
+    const CBlockIndex* pindexFork = chainActive.FindFork(mi->second);
+    if (pindexFork == NULL || pindexFork == chainActive.Tip())
+        return true;
+
+    for (const CBlockIndex* pindex = chainActive.Tip(); pindex != pindexFork; pindex = pindex->pprev) {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !(pindex->nStatus & BLOCK_HAVE_UNDO))
+            return error("%s: block %s needed to replay the indexes is pruned", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    LogPrintf("%s: replaying %d blocks to bring the indexes up to date\n", __func__, chainActive.Height() - pindexFork->nHeight);
+    CValidationState state;
+    while (chainActive.Tip() != pindexFork) {
+        if (!DisconnectTip(state, chainparams.GetConsensus()) || !state.IsValid())
+            return false;
+    }
+    mempool.clear();
+    // ActivateBestChain connects them again
+    return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+}
+
 void ReprocessBlocks(int nBlocks)
 {
     LOCK(cs_main);
@@ -2788,6 +3268,16 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
         nHeight = nTargetHeight;
 
+        // Start reading the blocks we are about to connect on the prefetch threads.
+        if (nScriptCheckThreads) {
+            std::vector<CBlockIndex*> vpindexPrefetch;
+            BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
+                if (!(pblock && pindexConnect == pindexMostWork))
+                    vpindexPrefetch.push_back(pindexConnect);
+            }
+            PrefetchBlocks(vpindexPrefetch);
+        }
+
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
             if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
@@ -2993,14 +3483,11 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = arenaBlockIndex.Create(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
     pindexNew->nSequenceId = 0;
-    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
@@ -3014,6 +3501,12 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
 //    pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + pindexNew->GetBlockWorkAdjusted();
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
+    {
+        // Only publish the entry once it is linked, see LookupBlockIndex
+        boost::unique_lock<boost::shared_mutex> lock(cs_mapBlockIndex);
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+        pindexNew->phashBlock = &((*mi).first);
+    }
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
         pindexBestHeader = pindexNew;
 
@@ -3185,11 +3678,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
-    if (!CheckBlockHeader(block, state, fCheckPOW))
+    if (!CheckBlockHeader(block, state, fCheckPOW && !block.fPrechecked))
         return false;
 
     // Check the merkle root.
-    if (fCheckMerkleRoot) {
+    if (fCheckMerkleRoot && !block.fPrechecked) {
         bool mutated;
         uint256 hashMerkleRoot2 = BlockMerkleRoot(block, &mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
@@ -3214,11 +3707,11 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                          REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
@@ -3229,7 +3722,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         // We should never accept block which conflicts with completed transaction lock,
         // that's why this is in CheckBlock unlike coinbase payee/amount.
         // Require other nodes to comply, send them some data in case they are missing it.
-        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
             // skip coinbase, it has no inputs
             if (tx.IsCoinBase()) continue;
             // LOOK FOR TRANSACTION LOCK IN OUR MAP OF OUTPOINTS
@@ -3253,16 +3747,18 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // END DASH
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock(): CheckTransaction of %s failed with %s",
-                tx.GetHash().ToString(),
-                FormatStateMessage(state));
+    if (!block.fPrechecked) {
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+            if (!CheckTransaction(*tx, state))
+                return error("CheckBlock(): CheckTransaction of %s failed with %s",
+                    tx->GetHash().ToString(),
+                    FormatStateMessage(state));
+    }
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*tx);
     }
     // sigops limits (relaxed)
     if (nSigOps > MaxBlockSigOps(true))
@@ -3359,7 +3855,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     // Check that all transactions are finalized and not over-sized
     // Also count sigops
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
             return state.DoS(10, error("%s: contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
@@ -3379,8 +3876,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (block.nVersion >= 2 && IsSuperMajority(2, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams))
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -3806,24 +4303,40 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("InsertBlockIndex(): new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.Create();
+    boost::unique_lock<boost::shared_mutex> lock(cs_mapBlockIndex);
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 2;
+
+static boost::filesystem::path GetBlockIndexSnapshotPath()
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
-        return false;
+    return GetDataDir() / "blockindex.dat";
+}
 
-    boost::this_thread::interruption_point();
+/**
+ * The snapshot holds every block index entry in height order, along with its
+ * chain work and the position of its skip pointer, so loading it needs
+ * neither the sort nor the chain work and skip list computation. It is only
+ * valid for the block tree database state it was written for: both carry
+ * the same random id, and the id is erased from the database as soon as the
+ * snapshot is read. The snapshot also records the best block and the last
+ * block file info, which are checked against the databases on load, so
+ * changes made by a node that doesn't know about the snapshot aren't missed.
+ */
+bool DumpBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    // Only write what is known to be in the database
+    if (fReindex || chainActive.Tip() == NULL || !setDirtyBlockIndex.empty() || !setDirtyFileInfo.empty())
+        return false;
 
-    // Calculate nChainWork
+    int64_t nStart = GetTimeMillis();
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -3832,11 +4345,198 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    // Generate random temporary filename
+    unsigned short randv = 0;
+    GetRandBytes((unsigned char*)&randv, sizeof(randv));
+    boost::filesystem::path pathTmp = GetDataDir() / strprintf("blockindex.dat.%04x", randv);
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s: Failed to open file %s", __func__, pathTmp.string());
+
+    uint256 id = GetRandHash();
+    try {
+        // serialize in chunks, checksum everything, then append csum
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        ss << FLATDATA(Params().MessageStart()) << BLOCK_INDEX_SNAPSHOT_VERSION << id;
+        ss << chainActive.Tip()->GetBlockHash() << nLastBlockFile << vinfoBlockFile[nLastBlockFile];
+        ss << (uint64_t)vSortedByHeight.size();
+
+        std::map<const CBlockIndex*, int32_t> mapPos;
+        for (size_t i = 0; i < vSortedByHeight.size(); i++) {
+            const CBlockIndex* pindex = vSortedByHeight[i].second;
+            mapPos[pindex] = i;
+            int32_t nSkip = pindex->pskip ? mapPos[pindex->pskip] : -1;
+            ss << CDiskBlockIndex(pindex) << ArithToUint256(pindex->nChainWork) << nSkip;
+            if (ss.size() >= (1 << 20) || i + 1 == vSortedByHeight.size()) {
+                hasher.write(&ss[0], ss.size());
+                fileout.write(&ss[0], ss.size());
+                ss.clear();
+            }
+        }
+        fileout << hasher.GetHash();
+    } catch (const std::exception& e) {
+        return error("%s: Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    // replace existing blockindex.dat, if any, and only then tie it to the database
+    if (!RenameOver(pathTmp, GetBlockIndexSnapshotPath()))
+        return error("%s: Rename-into-place failed", __func__);
+    if (!pblocktree->WriteIndexSnapshotId(id))
+        return error("%s: Failed to write snapshot id to block index database", __func__);
+
+    LogPrintf("Wrote %u block index entries to blockindex.dat  %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadBlockIndexSnapshot(vector<pair<int, CBlockIndex*> >& vSortedByHeight)
+{
+    uint256 idExpected;
+    if (!pblocktree->ReadIndexSnapshotId(idExpected))
+        return false;
+
+    // The database is going to change from here on, so whether the snapshot
+    // can be used or not, it must not be used again.
+    if (!pblocktree->EraseIndexSnapshotId())
+        return error("%s: Failed to erase snapshot id from block index database", __func__);
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    FILE *file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein(file, SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: Failed to open file %s", __func__, path.string());
+
+    uint256 hashBestChain;
+    vector<CDiskBlockIndex> vDiskIndex;
+    vector<uint256> vChainWork;
+    vector<int32_t> vSkip;
+    try {
+        CHashVerifier<CAutoFile> verifier(&filein);
+        unsigned char pchMsgTmp[4];
+        int nVersion;
+        uint256 id;
+        verifier >> FLATDATA(pchMsgTmp) >> nVersion >> id;
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+            return error("%s: Invalid network magic number", __func__);
+        if (nVersion != BLOCK_INDEX_SNAPSHOT_VERSION)
+            return error("%s: Unknown version %d", __func__, nVersion);
+        if (id != idExpected)
+            return error("%s: Snapshot doesn't match the block index database", __func__);
+
+        // A node that doesn't know about the snapshot leaves the id in place
+        // while it changes the databases, so check the state the snapshot was
+        // written for too.
+        int nLastFile;
+        CBlockFileInfo infoLastFile;
+        int nLastFileDB;
+        CBlockFileInfo infoLastFileDB;
+        verifier >> hashBestChain >> nLastFile >> infoLastFile;
+        if (hashBestChain != pcoinsTip->GetBestBlock())
+            return error("%s: Snapshot was written for another best block", __func__);
+        if (!pblocktree->ReadLastBlockFile(nLastFileDB) || nLastFileDB != nLastFile ||
+            !pblocktree->ReadBlockFileInfo(nLastFile, infoLastFileDB) || SerializeHash(infoLastFileDB) != SerializeHash(infoLastFile))
+            return error("%s: Snapshot doesn't match the last block file info", __func__);
+
+        uint64_t nCount;
+        verifier >> nCount;
+
+        for (uint64_t i = 0; i < nCount; i++) {
+            boost::this_thread::interruption_point();
+            CDiskBlockIndex diskindex;
+            uint256 nChainWork;
+            int32_t nSkip;
+            verifier >> diskindex >> nChainWork >> nSkip;
+            if (nSkip < -1 || nSkip >= (int64_t)i || (i > 0 && diskindex.nHeight < vDiskIndex.back().nHeight))
+                return error("%s: Entries out of order", __func__);
+            vDiskIndex.push_back(diskindex);
+            vChainWork.push_back(nChainWork);
+            vSkip.push_back(nSkip);
+        }
+
+        uint256 hashIn;
+        filein >> hashIn;
+        if (hashIn != verifier.GetHash())
+            return error("%s: Checksum mismatch, data corrupted", __func__);
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+
+    // The best block's entry must be the one in the database
+    CDiskBlockIndex diskindexBest;
+    vector<CDiskBlockIndex>::const_reverse_iterator itBest = vDiskIndex.rbegin();
+    while (itBest != vDiskIndex.rend() && itBest->GetBlockHash() != hashBestChain)
+        itBest++;
+    if (itBest == vDiskIndex.rend() || !pblocktree->ReadBlockIndex(hashBestChain, diskindexBest) ||
+        SerializeHash(*itBest, SER_DISK, CLIENT_VERSION) != SerializeHash(diskindexBest, SER_DISK, CLIENT_VERSION))
+        return error("%s: Snapshot doesn't match the best block's entry in the database", __func__);
+
+    // Entries were checked when they were first loaded from the database
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_mapBlockIndex);
+        mapBlockIndex.reserve(vDiskIndex.size());
+    }
+    vSortedByHeight.reserve(vDiskIndex.size());
+    for (size_t i = 0; i < vDiskIndex.size(); i++) {
+        CBlockIndex* pindexNew = InsertDiskBlockIndex(vDiskIndex[i], InsertBlockIndex);
+        pindexNew->nChainWork     = UintToArith256(vChainWork[i]);
+        pindexNew->pskip          = vSkip[i] >= 0 ? vSortedByHeight[vSkip[i]].second : NULL;
+        vSortedByHeight.push_back(make_pair(pindexNew->nHeight, pindexNew));
+    }
+
+    LogPrintf("Loaded %u block index entries from blockindex.dat  %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_mapBlockIndex);
+    BlockMap::const_iterator it = mapBlockIndex.find(hash);
+    return it == mapBlockIndex.end() ? NULL : it->second;
+}
+
+CChainView GetChainView()
+{
+    return CChainView(pindexChainView);
+}
+
+size_t BlockIndexDynamicUsage()
+{
+    return arenaBlockIndex.DynamicMemoryUsage() + memusage::DynamicUsage(mapBlockIndex);
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    bool fFromSnapshot = LoadBlockIndexSnapshot(vSortedByHeight);
+    if (!fFromSnapshot) {
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        {
+            CBlockIndex* pindex = item.second;
+            vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+        }
+        sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    }
+
+    // Calculate nChainWork, unless the snapshot had it already
     BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
     {
         CBlockIndex* pindex = item.second;
 //        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex); for DASH
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWorkAdjusted();
+        if (!fFromSnapshot)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + pindex->GetBlockWorkAdjusted();
 
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
@@ -3856,7 +4556,7 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fFromSnapshot)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
@@ -3865,6 +4565,7 @@ bool static LoadBlockIndexDB()
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
+    LogPrintf("%s: %u block index entries using %.1f MiB\n", __func__, mapBlockIndex.size(), BlockIndexDynamicUsage() / (1024.0 * 1024.0));
     LogPrintf("%s: last block file = %i\n", __func__, nLastBlockFile);
     for (int nFile = 0; nFile <= nLastBlockFile; nFile++) {
         pblocktree->ReadBlockFileInfo(nFile, vinfoBlockFile[nFile]);
@@ -3928,6 +4629,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    pindexChainView = it->second;
 
     PruneBlockIndexCandidates();
 
@@ -3991,7 +4693,7 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView *coinsview,
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
         if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
-            DisconnectResult res = DisconnectBlock(block, state, pindex, coins);
+            DisconnectResult res = DisconnectBlock(block, state, pindex, coins, true);
             if (res == DISCONNECT_FAILED) {
                 return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             }
@@ -4037,6 +4739,7 @@ void UnloadBlockIndex()
     LOCK(cs_main);
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    pindexChainView = NULL;
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
@@ -4051,10 +4754,11 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH(BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_mapBlockIndex);
+        mapBlockIndex.clear();
     }
-    mapBlockIndex.clear();
+    arenaBlockIndex.Clear();
     fHavePruned = false;
 }
 
@@ -4126,9 +4830,10 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
 
     int nLoaded = 0;
     try {
-        unsigned int nMaxBlockSize = MaxBlockSize(true);
+        // Records may hold compressed blocks, which are slightly larger at worst
+        unsigned int nMaxRecordSize = MaxCompressedBlockSize(MaxBlockSize(true));
         // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*nMaxBlockSize, nMaxBlockSize+8, SER_DISK, CLIENT_VERSION);
+        CBufferedFile blkdat(fileIn, 2*nMaxRecordSize, nMaxRecordSize+8, SER_DISK, CLIENT_VERSION);
         uint64_t nRewind = blkdat.GetPos();
         while (!blkdat.eof()) {
             boost::this_thread::interruption_point();
@@ -4147,7 +4852,7 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
                 // read size
                 blkdat >> nSize;
-                if (nSize < 80 || nSize > nMaxBlockSize)
+                if (nSize < 80 || nSize > nMaxRecordSize)
                     continue;
             } catch (const std::exception&) {
                 // no valid block header found; don't complain
@@ -4161,7 +4866,8 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 blkdat.SetLimit(nBlockPos + nSize);
                 blkdat.SetPos(nBlockPos);
                 CBlock block;
-                blkdat >> block;
+                CBlockCompressor blockIn(block);
+                blkdat >> blockIn;
                 nRewind = blkdat.GetPos();
 
                 // detect out of order blocks, and store them for later
@@ -4491,15 +5197,151 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+typedef std::pair<CTxLockRequest, std::vector<CTxLockVote> > TxLockDump;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMicros();
+    int64_t count = 0;
+    int64_t skipped = 0;
+    int64_t failed = 0;
+    int64_t nNow = GetTime();
+
+    std::vector<CTransactionRef> vtx;
+    std::vector<int64_t> vTime;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxLockDump> vLocks;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            return false;
+        }
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            CTransactionRef tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+            if (nTime + nExpiryTimeout > nNow) {
+                vtx.push_back(tx);
+                vTime.push_back(nTime);
+            } else {
+                ++skipped;
+            }
+        }
+        file >> mapDeltas;
+        file >> vLocks;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    typedef std::pair<double, CAmount> DeltaPair;
+    BOOST_FOREACH(const PAIRTYPE(uint256, DeltaPair)& delta, mapDeltas)
+        mempool.PrioritiseTransaction(delta.first, delta.first.ToString(), delta.second.first, delta.second.second);
+
+    // The scripts of a whole batch are verified on the script check threads
+    // first, so accepting it under cs_main mostly hits the signature cache
+    for (size_t nBatch = 0; nBatch < vtx.size(); nBatch += MEMPOOL_LOAD_BATCH_SIZE) {
+        if (ShutdownRequested())
+            return false;
+        size_t nBatchEnd = std::min(vtx.size(), nBatch + MEMPOOL_LOAD_BATCH_SIZE);
+        std::vector<CTransactionRef> vBatch(vtx.begin() + nBatch, vtx.begin() + nBatchEnd);
+        PreVerifyTransactionScripts(mempool, vBatch);
+
+        LOCK(cs_main);
+        for (size_t i = nBatch; i < nBatchEnd; i++) {
+            CValidationState state;
+            if (AcceptToMemoryPoolWithTime(mempool, state, vtx[i], true, NULL, vTime[i]))
+                ++count;
+            else
+                ++failed;
+        }
+    }
+
+    int nLocks = 0;
+    BOOST_FOREACH(const TxLockDump& txLock, vLocks) {
+        if (mempool.exists(txLock.first.GetHash()) && instantsend.RestoreTxLock(txLock.first, txLock.second))
+            nLocks++;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired, %i InstantSend locks, %.2fs\n",
+              count, failed, skipped, nLocks, (GetTimeMicros() - nStart) * 0.000001);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t start = GetTimeMicros();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxMempoolInfo> vinfo;
+
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vinfo = mempool.infoAll();
+    }
+
+    std::vector<TxLockDump> vLocks;
+    BOOST_FOREACH(const TxMempoolInfo& i, vinfo) {
+        CTxLockRequest txLockRequest;
+        if (instantsend.GetTxLockRequest(i.tx->GetHash(), txLockRequest) && txLockRequest)
+            vLocks.push_back(std::make_pair(txLockRequest, instantsend.GetTxLockVotes(i.tx->GetHash())));
+    }
+
+    int64_t mid = GetTimeMicros();
+
+    try {
+        FILE* filestr = fopen((GetDataDir() / "mempool.dat.new").string().c_str(), "wb");
+        if (!filestr) {
+            return false;
+        }
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        uint64_t version = MEMPOOL_DUMP_VERSION;
+        file << version;
+
+        file << (uint64_t)vinfo.size();
+        BOOST_FOREACH(const TxMempoolInfo& i, vinfo) {
+            file << i.tx;
+            file << i.nTime;
+        }
+
+        file << mapDeltas;
+        file << vLocks;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+        int64_t last = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*0.000001, (last-mid)*0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 class CMainCleanup
 {
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
         // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
+        arenaBlockIndex.Clear();
     }
 } instance_of_cmaincleanup;
@@ -4,6 +4,12 @@
 
 #include "wallet/wallet.h"
 
+#include "privatesend.h"
+#include "random.h"
+#include "script/standard.h"
+#include "validation.h"
+#include "wallet/walletdb.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -23,6 +29,8 @@
 
 using namespace std;
 
+extern CWallet* pwalletMain;
+
 typedef set<pair<const CWalletTx*,unsigned int> > CoinSet;
 
 BOOST_FIXTURE_TEST_SUITE(wallet_tests, TestingSetup)
@@ -328,6 +336,45 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(exact_subset_tests)
+{
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    LOCK(wallet.cs_wallet);
+
+    for (int i = 0; i < RUN_TESTS; i++)
+    {
+        empty_wallet();
+
+        // several subsets add up to 23 cents exactly, e.g. 3+7+13 or 1+3+19
+        add_coin( 1*CENT);
+        add_coin( 2*CENT);
+        add_coin( 3*CENT);
+        add_coin( 7*CENT);
+        add_coin(13*CENT);
+        add_coin(17*CENT);
+        add_coin(19*CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(23 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 23 * CENT);
+
+        // 61 cents is all 62 cents but 1, the search has to exclude exactly the smallest coin
+        BOOST_CHECK( wallet.SelectCoinsMinConf(61 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 61 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 6U);
+
+        // many coins of the same value don't blow up the search
+        empty_wallet();
+        for (int j = 0; j < 500; j++)
+            add_coin(10 * CENT);
+        add_coin(3 * CENT);
+        BOOST_CHECK( wallet.SelectCoinsMinConf(203 * CENT, 1, 6, vCoins, setCoinsRet, nValueRet));
+        BOOST_CHECK_EQUAL(nValueRet, 203 * CENT);
+        BOOST_CHECK_EQUAL(setCoinsRet.size(), 21U);
+    }
+    empty_wallet();
+}
+
 BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
 {
     CoinSet setCoinsRet;
@@ -361,4 +408,170 @@ BOOST_AUTO_TEST_CASE(ApproximateBestSubset)
     BOOST_CHECK_EQUAL(setCoinsRet.size(), 101);
 }
 
+static bool HaveAvailableCoin(const CWallet& wallet, const COutPoint& outpoint)
+{
+    std::vector<COutput> vAvailable;
+    wallet.AvailableCoins(vAvailable);
+    BOOST_FOREACH(const COutput& out, vAvailable) {
+        if (out.tx->GetHash() == outpoint.hash && out.i == (int)outpoint.n)
+            return true;
+    }
+    return false;
+}
+
+BOOST_FIXTURE_TEST_CASE(wallet_utxo_balances, TestChain100Setup)
+{
+    CWallet testWallet;
+    {
+        LOCK(testWallet.cs_wallet);
+        testWallet.AddKeyPubKey(coinbaseKey, coinbaseKey.GetPubKey());
+    }
+    // Nothing scanned yet, this also fills the balance cache
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), 0);
+
+    CKey otherKey;
+    otherKey.MakeNewKey(true);
+    CScript ourScript = GetScriptForDestination(coinbaseKey.GetPubKey().GetID());
+    CScript otherScript = GetScriptForDestination(otherKey.GetPubKey().GetID());
+
+    // Spend the first coinbase, half to us and half to a key the wallet
+    // doesn't know about yet
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vout.resize(2);
+    spend.vout[0].nValue = coinbaseTxns[0].vout[0].nValue / 2;
+    spend.vout[0].scriptPubKey = ourScript;
+    spend.vout[1].nValue = coinbaseTxns[0].vout[0].nValue / 4;
+    spend.vout[1].scriptPubKey = otherScript;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(coinbaseTxns[0].vout[0].scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    CreateAndProcessBlock(std::vector<CMutableTransaction>(1, spend), otherScript);
+    const uint256 spendHash = spend.GetHash();
+
+    // Adding the transactions refreshes the cache and the UTXO set: the
+    // spent coinbase is gone, none of the others are mature yet
+    testWallet.ScanForWalletTransactions(chainActive.Genesis(), true);
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), spend.vout[0].nValue);
+    BOOST_CHECK(HaveAvailableCoin(testWallet, COutPoint(spendHash, 0)));
+    BOOST_CHECK(!HaveAvailableCoin(testWallet, COutPoint(spendHash, 1)));
+    BOOST_CHECK(!HaveAvailableCoin(testWallet, COutPoint(coinbaseTxns[0].GetHash(), 0)));
+
+    // Importing the other key without a rescan makes its output ours
+    {
+        LOCK(testWallet.cs_wallet);
+        testWallet.AddKeyPubKey(otherKey, otherKey.GetPubKey());
+    }
+    testWallet.MarkDirty();
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), spend.vout[0].nValue + spend.vout[1].nValue);
+    BOOST_CHECK(HaveAvailableCoin(testWallet, COutPoint(spendHash, 1)));
+
+    // Spending our output elsewhere takes it out of both
+    CKey thirdKey;
+    thirdKey.MakeNewKey(true);
+    CMutableTransaction spend2;
+    spend2.vin.resize(1);
+    spend2.vin[0].prevout = COutPoint(spendHash, 0);
+    spend2.vout.resize(1);
+    spend2.vout[0].nValue = spend.vout[0].nValue / 2;
+    spend2.vout[0].scriptPubKey = GetScriptForDestination(thirdKey.GetPubKey().GetID());
+    {
+        LOCK2(cs_main, testWallet.cs_wallet);
+        BOOST_CHECK(testWallet.AddToWalletIfInvolvingMe(spend2, NULL, false));
+    }
+    BOOST_CHECK_EQUAL(testWallet.GetBalance(), spend.vout[1].nValue);
+    BOOST_CHECK(!HaveAvailableCoin(testWallet, COutPoint(spendHash, 0)));
+    BOOST_CHECK(HaveAvailableCoin(testWallet, COutPoint(spendHash, 1)));
+}
+
+static bool ReadRounds(const COutPoint& outpoint, int& nRounds)
+{
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+    return walletdb.ReadPrivateSendRounds(outpoint, nRounds);
+}
+
+BOOST_AUTO_TEST_CASE(wallet_privatesend_rounds)
+{
+    CPrivateSend::InitStandardDenominations();
+    const CAmount nDenom = CPrivateSend::GetSmallestDenomination();
+
+    CKey key, otherKey;
+    key.MakeNewKey(true);
+    otherKey.MakeNewKey(true);
+    CScript ourScript = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript otherScript = GetScriptForDestination(otherKey.GetPubKey().GetID());
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(key, key.GetPubKey()));
+
+    // Denominated outputs to us and somebody else, funded from elsewhere
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx1.vout.push_back(CTxOut(nDenom, ourScript));
+    tx1.vout.push_back(CTxOut(nDenom, otherScript));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(tx1, NULL, true));
+
+    // One mixing round on top of our output
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vout.push_back(CTxOut(nDenom, ourScript));
+    tx2.vout.push_back(CTxOut(nDenom, otherScript));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(tx2, NULL, true));
+
+    // A non-denominated output and a denominated one spending somebody else's coin
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    tx3.vout.push_back(CTxOut(nDenom, ourScript));
+    CMutableTransaction tx4;
+    tx4.vin.resize(1);
+    tx4.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx4.vout.push_back(CTxOut(5 * COIN, ourScript));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(tx3, NULL, true));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(tx4, NULL, true));
+
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx2.GetHash(), 0)), 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx1.GetHash(), 0)), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx2.GetHash(), 1)), 1);
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx3.GetHash(), 0)), 0);
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx4.GetHash(), 0)), -2);
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(GetRandHash(), 0)), -1);
+
+    // Only our unspent denominated outputs are written, and only once asked to
+    int nRounds;
+    BOOST_CHECK(!ReadRounds(COutPoint(tx2.GetHash(), 0), nRounds));
+    pwalletMain->WritePrivateSendRounds();
+    BOOST_CHECK(ReadRounds(COutPoint(tx2.GetHash(), 0), nRounds));
+    BOOST_CHECK_EQUAL(nRounds, 1);
+    BOOST_CHECK(ReadRounds(COutPoint(tx3.GetHash(), 0), nRounds));
+    BOOST_CHECK_EQUAL(nRounds, 0);
+    BOOST_CHECK(!ReadRounds(COutPoint(tx1.GetHash(), 0), nRounds));
+    BOOST_CHECK(!ReadRounds(COutPoint(tx2.GetHash(), 1), nRounds));
+    BOOST_CHECK(!ReadRounds(COutPoint(tx4.GetHash(), 0), nRounds));
+
+    // Spending an output erases its record
+    CMutableTransaction tx5;
+    tx5.vin.resize(1);
+    tx5.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx5.vout.push_back(CTxOut(nDenom, otherScript));
+    BOOST_CHECK(pwalletMain->AddToWalletIfInvolvingMe(tx5, NULL, true));
+    pwalletMain->WritePrivateSendRounds();
+    BOOST_CHECK(!ReadRounds(COutPoint(tx2.GetHash(), 0), nRounds));
+
+    // Importing the other key makes the input of tx3 ours, which adds a round to its output
+    BOOST_CHECK(pwalletMain->AddKeyPubKey(otherKey, otherKey.GetPubKey()));
+    pwalletMain->MarkDirty();
+    pwalletMain->WritePrivateSendRounds();
+    BOOST_CHECK(!ReadRounds(COutPoint(tx3.GetHash(), 0), nRounds));
+    BOOST_CHECK_EQUAL(pwalletMain->GetRealOutpointPrivateSendRounds(COutPoint(tx3.GetHash(), 0)), 1);
+    pwalletMain->WritePrivateSendRounds();
+    BOOST_CHECK(ReadRounds(COutPoint(tx3.GetHash(), 0), nRounds));
+    BOOST_CHECK_EQUAL(nRounds, 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
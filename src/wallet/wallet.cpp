@@ -588,6 +588,7 @@ set<uint256> CWallet::GetConflicts(const uint256& txid) const
 
 void CWallet::Flush(bool shutdown)
 {
+    WritePrivateSendRounds();
     bitdb.Flush(shutdown);
 }
 
@@ -703,6 +704,11 @@ void CWallet::AddToSpends(const COutPoint& outpoint, const uint256& wtxid)
     mapTxSpends.insert(make_pair(outpoint, wtxid));
     setWalletUTXO.erase(outpoint);
 
+    // a spent output can't be mixed any further, drop its record but keep the rounds for its descendants
+    std::map<COutPoint, int>::const_iterator itRounds = mapOutpointRoundsCache.find(outpoint);
+    if (fFileBacked && itRounds != mapOutpointRoundsCache.end() && itRounds->second >= 0)
+        mapOutpointRoundsToWrite[outpoint] = -1;
+
     pair<TxSpends::iterator, TxSpends::iterator> range;
     range = mapTxSpends.equal_range(outpoint);
     SyncMetaData(range);
@@ -720,6 +726,28 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+void CWallet::AddToWalletUTXO(const CWalletTx& wtx)
+{
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); ++i) {
+        if (IsMine(wtx.vout[i]) && !IsSpent(hash, i)) {
+            setWalletUTXO.insert(COutPoint(hash, i));
+        }
+    }
+}
+
+void CWallet::GetWalletUTXOTxes(std::vector<const CWalletTx*>& vWalletTxesRet) const
+{
+    vWalletTxesRet.clear();
+    // outputs of the same transaction are adjacent in setWalletUTXO
+    for (auto& outpoint : setWalletUTXO) {
+        if (!vWalletTxesRet.empty() && vWalletTxesRet.back()->GetHash() == outpoint.hash) continue;
+        const CWalletTx* pcoin = GetWalletTx(outpoint.hash);
+        if (pcoin != NULL)
+            vWalletTxesRet.push_back(pcoin);
+    }
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -868,13 +896,19 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 void CWallet::MarkDirty()
 {
     {
-        LOCK(cs_wallet);
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+        LOCK2(cs_main, cs_wallet);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet) {
             item.second.MarkDirty();
+            // outputs might have become ours (e.g. after an import)
+            AddToWalletUTXO(item.second);
+        }
+        // so the PrivateSend rounds of anything spending them may have changed too
+        ClearPrivateSendRounds();
     }
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
 }
 
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb)
@@ -956,11 +990,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
-            for(unsigned int i = 0; i < wtx.vout.size(); ++i) {
-                if (IsMine(wtx.vout[i]) && !IsSpent(hash, i)) {
-                    setWalletUTXO.insert(COutPoint(hash, i));
-                }
-            }
+            InvalidatePrivateSendRounds(hash);
         }
 
         bool fUpdated = false;
@@ -990,6 +1020,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
             }
         }
 
+        AddToWalletUTXO(wtx);
+
         //// debug print
         LogPrintf("AddToWallet %s  %s%s\n", wtxIn.GetHash().ToString(), (fInsertedNew ? "new" : ""), (fUpdated ? "update" : ""));
 
@@ -1015,6 +1047,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         fAnonymizableTallyCached = false;
         fAnonymizableTallyCachedNonDenom = false;
+        fBalancesCached = false;
 
     }
     return true;
@@ -1112,14 +1145,17 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             // available of the outputs it spends. So force those to be recomputed
             BOOST_FOREACH(const CTxIn& txin, wtx.vin)
             {
-                if (mapWallet.count(txin.prevout.hash))
+                if (mapWallet.count(txin.prevout.hash)) {
                     mapWallet[txin.prevout.hash].MarkDirty();
+                    AddToWalletUTXO(mapWallet[txin.prevout.hash]);
+                }
             }
         }
     }
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
 
     return true;
 }
@@ -1176,18 +1212,22 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             // available of the outputs it spends. So force those to be recomputed
             BOOST_FOREACH(const CTxIn& txin, wtx.vin)
             {
-                if (mapWallet.count(txin.prevout.hash))
+                if (mapWallet.count(txin.prevout.hash)) {
                     mapWallet[txin.prevout.hash].MarkDirty();
+                    AddToWalletUTXO(mapWallet[txin.prevout.hash]);
+                }
             }
         }
     }
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
 }
 
-void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+void CWallet::SyncTransaction(const CTransactionRef& ptx, const CBlock* pblock)
 {
+    const CTransaction& tx = *ptx;
     LOCK2(cs_main, cs_wallet);
 
     if (!AddToWalletIfInvolvingMe(tx, pblock, true))
@@ -1198,12 +1238,23 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
     // recomputed, also:
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        if (mapWallet.count(txin.prevout.hash))
+        if (mapWallet.count(txin.prevout.hash)) {
             mapWallet[txin.prevout.hash].MarkDirty();
+            AddToWalletUTXO(mapWallet[txin.prevout.hash]);
+        }
     }
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
+}
+
+void CWallet::NotifyTransactionLock(const CTransaction& tx)
+{
+    LOCK(cs_wallet);
+    // InstantSend locked transactions are counted as confirmed, see CMerkleTx::GetDepthInMainChain()
+    if (mapWallet.count(tx.GetHash()))
+        fBalancesCached = false;
 }
 
 
@@ -1238,90 +1289,168 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
     return 0;
 }
 
-// Recursively determine the rounds of a given input (How deep is the PrivateSend chain for a given input)
-int CWallet::GetRealOutpointPrivateSendRounds(const COutPoint& outpoint, int nRounds) const
+// Determine the rounds of a given input (How deep is the PrivateSend chain for a given input).
+// Walks the in-wallet ancestry with an explicit stack and memoizes every outpoint it resolves
+// in mapOutpointRoundsCache, so each outpoint is computed at most once until it is invalidated.
+int CWallet::GetRealOutpointPrivateSendRounds(const COutPoint& outpoint) const
 {
-    static std::map<uint256, CMutableTransaction> mDenomWtxes;
+    LOCK(cs_wallet);
 
-    if(nRounds >= 16) return 15; // 16 rounds max
+    std::map<COutPoint, int>::const_iterator it = mapOutpointRoundsCache.find(outpoint);
+    if (it != mapOutpointRoundsCache.end())
+        return it->second;
 
-    uint256 hash = outpoint.hash;
-    unsigned int nout = outpoint.n;
+    // not a wallet tx, nothing to cache
+    if (GetWalletTx(outpoint.hash) == NULL)
+        return -1;
 
-    const CWalletTx* wtx = GetWalletTx(hash);
-    if(wtx != NULL)
-    {
-        std::map<uint256, CMutableTransaction>::const_iterator mdwi = mDenomWtxes.find(hash);
-        if (mdwi == mDenomWtxes.end()) {
-            // not known yet, let's add it
-            LogPrint("privatesend", "GetRealOutpointPrivateSendRounds INSERTING %s\n", hash.ToString());
-            mDenomWtxes[hash] = CMutableTransaction(*wtx);
-        } else if(mDenomWtxes[hash].vout[nout].nRounds != -10) {
-            // found and it's not an initial value, just return it
-            return mDenomWtxes[hash].vout[nout].nRounds;
+    std::vector<COutPoint> vecStack(1, outpoint);
+    while (!vecStack.empty()) {
+        const COutPoint current = vecStack.back();
+        if (mapOutpointRoundsCache.count(current)) {
+            vecStack.pop_back();
+            continue;
         }
 
+        const CWalletTx* wtx = GetWalletTx(current.hash);
+        int nRounds;
+        if (wtx == NULL) {
+            // should never actually hit this, inputs are only followed if they are ours
+            nRounds = -1;
+        } else if (current.n >= wtx->vout.size()) {
+            // bounds check, should never actually hit this either
+            nRounds = -4;
+        } else if (CPrivateSend::IsCollateralAmount(wtx->vout[current.n].nValue)) {
+            nRounds = -3;
+        } else if (!CPrivateSend::IsDenominatedAmount(wtx->vout[current.n].nValue)) {
+            //make sure the final output is non-denominate
+            nRounds = -2;
+        } else {
+            bool fAllDenoms = true;
+            BOOST_FOREACH(const CTxOut& out, wtx->vout) {
+                fAllDenoms = fAllDenoms && CPrivateSend::IsDenominatedAmount(out.nValue);
+            }
 
-        // bounds check
-        if (nout >= wtx->vout.size()) {
-            // should never actually hit this
-            LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, -4);
-            return -4;
+            if (!fAllDenoms) {
+                // this one is denominated but there is another non-denominated output found in the same tx
+                nRounds = 0;
+            } else {
+                int nShortest = -10; // an initial value, should be no way to get this by calculations
+                bool fPending = false;
+                // only denoms here so let's look up
+                BOOST_FOREACH(const CTxIn& txinNext, wtx->vin) {
+                    if (!IsMine(txinNext)) continue;
+                    it = mapOutpointRoundsCache.find(txinNext.prevout);
+                    if (it == mapOutpointRoundsCache.end()) {
+                        // resolve the input first and come back to this one later
+                        vecStack.push_back(txinNext.prevout);
+                        fPending = true;
+                        continue;
+                    }
+                    // denom found, find the shortest chain or initially assign nShortest with the first found value
+                    if (it->second >= 0 && (it->second < nShortest || nShortest == -10)) {
+                        nShortest = it->second;
+                    }
+                }
+                if (fPending) continue;
+                nRounds = nShortest != -10
+                        ? (nShortest >= MAX_PRIVATESEND_ROUNDS - 1 ? MAX_PRIVATESEND_ROUNDS : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
+                        : 0;            // too bad, we are the fist one in that chain
+            }
         }
 
-        if (CPrivateSend::IsCollateralAmount(wtx->vout[nout].nValue)) {
-            mDenomWtxes[hash].vout[nout].nRounds = -3;
-            LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+        mapOutpointRoundsCache[current] = nRounds;
+        // only unspent denominated outputs of ours are worth keeping across restarts
+        if (fFileBacked && nRounds >= 0 && IsMine(wtx->vout[current.n]) && !mapTxSpends.count(current))
+            mapOutpointRoundsToWrite[current] = nRounds;
+        vecStack.pop_back();
+        LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", current.hash.ToString(), current.n, nRounds);
+    }
 
-        //make sure the final output is non-denominate
-        if (!CPrivateSend::IsDenominatedAmount(wtx->vout[nout].nValue)) { //NOT DENOM
-            mDenomWtxes[hash].vout[nout].nRounds = -2;
-            LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
-        }
+    return mapOutpointRoundsCache[outpoint];
+}
 
-        bool fAllDenoms = true;
-        BOOST_FOREACH(CTxOut out, wtx->vout) {
-            fAllDenoms = fAllDenoms && CPrivateSend::IsDenominatedAmount(out.nValue);
-        }
+void CWallet::LoadPrivateSendRounds(const COutPoint& outpoint, int nRounds)
+{
+    LOCK(cs_wallet);
+    mapOutpointRoundsCache[outpoint] = nRounds;
+}
 
-        // this one is denominated but there is another non-denominated output found in the same tx
-        if (!fAllDenoms) {
-            mDenomWtxes[hash].vout[nout].nRounds = 0;
-            LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-            return mDenomWtxes[hash].vout[nout].nRounds;
+// Rounds of an outpoint only depend on its in-wallet ancestry, so a (re)added transaction
+// can only change the cached rounds of its own outputs and of its in-wallet descendants.
+void CWallet::InvalidatePrivateSendRounds(const uint256& hashTx)
+{
+    AssertLockHeld(cs_wallet);
+
+    if (mapOutpointRoundsCache.empty())
+        return;
+
+    std::set<uint256> todo;
+    std::set<uint256> done;
+
+    todo.insert(hashTx);
+
+    while (!todo.empty()) {
+        uint256 now = *todo.begin();
+        todo.erase(now);
+        done.insert(now);
+
+        std::map<COutPoint, int>::iterator it = mapOutpointRoundsCache.lower_bound(COutPoint(now, 0));
+        while (it != mapOutpointRoundsCache.end() && it->first.hash == now) {
+            if (fFileBacked && it->second >= 0)
+                mapOutpointRoundsToWrite[it->first] = -1;
+            mapOutpointRoundsCache.erase(it++);
         }
 
-        int nShortest = -10; // an initial value, should be no way to get this by calculations
-        bool fDenomFound = false;
-        // only denoms here so let's look up
-        BOOST_FOREACH(CTxIn txinNext, wtx->vin) {
-            if (IsMine(txinNext)) {
-                int n = GetRealOutpointPrivateSendRounds(txinNext.prevout, nRounds + 1);
-                // denom found, find the shortest chain or initially assign nShortest with the first found value
-                if(n >= 0 && (n < nShortest || nShortest == -10)) {
-                    nShortest = n;
-                    fDenomFound = true;
-                }
+        // Iterate over all its outputs, and invalidate transactions in the wallet that spend them too
+        TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
+        while (iter != mapTxSpends.end() && iter->first.hash == now) {
+            if (!done.count(iter->second)) {
+                todo.insert(iter->second);
             }
+            iter++;
         }
-        mDenomWtxes[hash].vout[nout].nRounds = fDenomFound
-                ? (nShortest >= 15 ? 16 : nShortest + 1) // good, we a +1 to the shortest one but only 16 rounds max allowed
-                : 0;            // too bad, we are the fist one in that chain
-        LogPrint("privatesend", "GetRealOutpointPrivateSendRounds UPDATED   %s %3d %3d\n", hash.ToString(), nout, mDenomWtxes[hash].vout[nout].nRounds);
-        return mDenomWtxes[hash].vout[nout].nRounds;
     }
+}
+
+void CWallet::ClearPrivateSendRounds()
+{
+    AssertLockHeld(cs_wallet);
 
-    return nRounds - 1;
+    if (fFileBacked) {
+        for (std::map<COutPoint, int>::const_iterator it = mapOutpointRoundsCache.begin(); it != mapOutpointRoundsCache.end(); ++it) {
+            if (it->second >= 0)
+                mapOutpointRoundsToWrite[it->first] = -1;
+        }
+    }
+    mapOutpointRoundsCache.clear();
+}
+
+void CWallet::WritePrivateSendRounds()
+{
+    LOCK(cs_wallet);
+
+    if (!fFileBacked || mapOutpointRoundsToWrite.empty())
+        return;
+
+    CWalletDB walletdb(strWalletFile, "r+", false);
+    if (!walletdb.TxnBegin())
+        return;
+    for (std::map<COutPoint, int>::const_iterator it = mapOutpointRoundsToWrite.begin(); it != mapOutpointRoundsToWrite.end(); ++it) {
+        if (it->second < 0)
+            walletdb.ErasePrivateSendRounds(it->first);
+        else
+            walletdb.WritePrivateSendRounds(it->first, it->second);
+    }
+    if (walletdb.TxnCommit())
+        mapOutpointRoundsToWrite.clear();
 }
 
 // respect current settings
 int CWallet::GetOutpointPrivateSendRounds(const COutPoint& outpoint) const
 {
     LOCK(cs_wallet);
-    int realPrivateSendRounds = GetRealOutpointPrivateSendRounds(outpoint, 0);
+    int realPrivateSendRounds = GetRealOutpointPrivateSendRounds(outpoint);
     return realPrivateSendRounds > privateSendClient.nPrivateSendRounds ? privateSendClient.nPrivateSendRounds : realPrivateSendRounds;
 }
 
@@ -1701,9 +1830,9 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
             CBlock block;
             ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+                if (AddToWalletIfInvolvingMe(*tx, &block, fUpdate))
                     ret++;
             }
             pindex = chainActive.Next(pindex);
@@ -2128,20 +2257,48 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman
  */
 
 
-CAmount CWallet::GetBalance() const
+const CWalletBalances& CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
+    LOCK2(cs_main, cs_wallet);
+
+    const uint256 hashTip = chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256();
+    const unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (fBalancesCached && hashBalancesCachedTip == hashTip && nBalancesCachedMempoolUpdated == nMempoolUpdated)
+        return balancesCached;
+
+    CWalletBalances balances;
+    std::vector<const CWalletTx*> vWalletTxes;
+    GetWalletUTXOTxes(vWalletTxes);
+    BOOST_FOREACH(const CWalletTx* pcoin, vWalletTxes)
     {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+        if (pcoin->IsTrusted()) {
+            balances.nBalance += pcoin->GetAvailableCredit();
+            balances.nWatchOnlyBalance += pcoin->GetAvailableWatchOnlyCredit();
+            if (!fLiteMode)
+                balances.nAnonymizedBalance += pcoin->GetAnonymizedCredit();
+        } else if (pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool()) {
+            balances.nUnconfirmedBalance += pcoin->GetAvailableCredit();
+            balances.nUnconfirmedWatchOnlyBalance += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        balances.nImmatureBalance += pcoin->GetImmatureCredit();
+        balances.nImmatureWatchOnlyBalance += pcoin->GetImmatureWatchOnlyCredit();
+        if (!fLiteMode) {
+            balances.nDenominatedBalance += pcoin->GetDenominatedCredit(false);
+            balances.nUnconfirmedDenominatedBalance += pcoin->GetDenominatedCredit(true);
         }
     }
 
-    return nTotal;
+    balancesCached = balances;
+    hashBalancesCachedTip = hashTip;
+    nBalancesCachedMempoolUpdated = nMempoolUpdated;
+    fBalancesCached = true;
+    return balancesCached;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nBalance;
 }
 
 CAmount CWallet::GetAnonymizableBalance(bool fSkipDenominated, bool fSkipUnconfirmed) const
@@ -2170,23 +2327,8 @@ CAmount CWallet::GetAnonymizedBalance() const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-
     LOCK2(cs_main, cs_wallet);
-
-    std::set<uint256> setWalletTxesCounted;
-    for (auto& outpoint : setWalletUTXO) {
-
-        if (setWalletTxesCounted.find(outpoint.hash) != setWalletTxesCounted.end()) continue;
-        setWalletTxesCounted.insert(outpoint.hash);
-
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.find(outpoint.hash); it != mapWallet.end() && it->first == outpoint.hash; ++it) {
-            if (it->second.IsTrusted())
-                nTotal += it->second.GetAnonymizedCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nAnonymizedBalance;
 }
 
 // Note: calculated including unconfirmed,
@@ -2261,92 +2403,38 @@ CAmount CWallet::GetDenominatedBalance(bool unconfirmed) const
 {
     if(fLiteMode) return 0;
 
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            nTotal += pcoin->GetDenominatedCredit(unconfirmed);
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return unconfirmed ? GetBalances().nUnconfirmedDenominatedBalance : GetBalances().nDenominatedBalance;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmedBalance;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmatureBalance;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nWatchOnlyBalance;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nUnconfirmedWatchOnlyBalance;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    return GetBalances().nImmatureWatchOnlyBalance;
 }
 
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue, AvailableCoinsType nCoinType, bool fUseInstantSend) const
@@ -2355,10 +2443,11 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        std::vector<const CWalletTx*> vWalletTxes;
+        GetWalletUTXOTxes(vWalletTxes);
+        BOOST_FOREACH(const CWalletTx* pcoin, vWalletTxes)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const uint256& wtxid = pcoin->GetHash();
 
             if (!CheckFinalTx(*pcoin))
                 continue;
@@ -2379,7 +2468,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             if (nDepth == 0 && !pcoin->InMempool())
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+            // only look at outputs which are in setWalletUTXO, all others are spent or not ours
+            for (std::set<COutPoint>::const_iterator itUTXO = setWalletUTXO.lower_bound(COutPoint(wtxid, 0));
+                    itUTXO != setWalletUTXO.end() && itUTXO->hash == wtxid; ++itUTXO) {
+                const unsigned int i = itUTXO->n;
                 bool found = false;
                 if(nCoinType == ONLY_DENOMINATED) {
                     found = CPrivateSend::IsDenominatedAmount(pcoin->vout[i].nValue);
@@ -2397,9 +2489,9 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    (!IsLockedCoin((*it).first, i) || nCoinType == ONLY_1000) &&
+                    (!IsLockedCoin(wtxid, i) || nCoinType == ONLY_1000) &&
                     (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint((*it).first, i))))
+                    (!coinControl || !coinControl->HasSelected() || coinControl->fAllowOtherInputs || coinControl->IsSelected(COutPoint(wtxid, i))))
                         vCoins.push_back(COutput(pcoin, i, nDepth,
                                                  ((mine & ISMINE_SPENDABLE) != ISMINE_NO) ||
                                                   (coinControl && coinControl->fAllowWatchOnly && (mine & ISMINE_WATCH_SOLVABLE) != ISMINE_NO),
@@ -2468,6 +2560,65 @@ static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,uns
     }
 }
 
+/**
+ * Depth first branch and bound search for a subset of vValue (sorted by descending value)
+ * that adds up to exactly nTargetValue, so that no change output is needed.
+ * Every step either includes the next coin or excludes it. A branch is cut as soon as it
+ * overshoots the target or when the coins left can't make up for the missing amount.
+ * Coins of the same value as an excluded one are excluded as well, as including them
+ * would only revisit combinations that were already tried.
+ */
+static bool SelectCoinsBnB(const vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >& vValue, const CAmount& nTargetValue,
+                           vector<char>& vfBest, int nMaxTries = 100000)
+{
+    CAmount nAvailable = 0;
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        nAvailable += vValue[i].first;
+    if (nAvailable < nTargetValue)
+        return false;
+
+    vector<char> vfSelection;
+    vfSelection.reserve(vValue.size());
+    CAmount nTotal = 0;
+
+    for (int nTry = 0; nTry < nMaxTries; nTry++)
+    {
+        bool fBacktrack = false;
+        if (nTotal + nAvailable < nTargetValue || nTotal > nTargetValue) {
+            // can't reach the target anymore or already overshot it
+            fBacktrack = true;
+        } else if (nTotal == nTargetValue) {
+            vfBest.assign(vValue.size(), false);
+            for (unsigned int i = 0; i < vfSelection.size(); i++)
+                vfBest[i] = vfSelection[i];
+            return true;
+        }
+
+        if (fBacktrack) {
+            // walk back to the last included coin and exclude it instead
+            while (!vfSelection.empty() && !vfSelection.back()) {
+                vfSelection.pop_back();
+                nAvailable += vValue[vfSelection.size()].first;
+            }
+            if (vfSelection.empty())
+                return false; // search space exhausted
+            vfSelection.back() = false;
+            nTotal -= vValue[vfSelection.size() - 1].first;
+        } else {
+            const unsigned int i = vfSelection.size();
+            nAvailable -= vValue[i].first;
+            if (i > 0 && !vfSelection.back() && vValue[i].first == vValue[i - 1].first) {
+                vfSelection.push_back(false);
+            } else {
+                vfSelection.push_back(true);
+                nTotal += vValue[i].first;
+            }
+        }
+    }
+
+    return false;
+}
+
 // move denoms down
 bool less_then_denom (const COutput& out1, const COutput& out2)
 {
@@ -2484,8 +2635,29 @@ bool less_then_denom (const COutput& out1, const COutput& out2)
     return (!found1 && found2);
 }
 
+// shuffle the coins and move denoms down, see SelectCoinsMinConfSorted()
+static void SortCoinsForSelection(vector<COutput>& vCoins)
+{
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+
+    // move denoms down on the list
+    sort(vCoins.begin(), vCoins.end(), less_then_denom);
+}
+
+static bool IsEligibleForSelection(const COutput& output, int nConfMine, int nConfTheirs)
+{
+    return output.fSpendable && output.nDepth >= (output.tx->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs);
+}
+
 bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
                                  set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseInstantSend) const
+{
+    SortCoinsForSelection(vCoins);
+    return SelectCoinsMinConfSorted(nTargetValue, nConfMine, nConfTheirs, vCoins, setCoinsRet, nValueRet, fUseInstantSend);
+}
+
+bool CWallet::SelectCoinsMinConfSorted(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                                       set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseInstantSend) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
@@ -2499,11 +2671,6 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
     CAmount nTotalLower = 0;
 
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    // move denoms down on the list
-    sort(vCoins.begin(), vCoins.end(), less_then_denom);
-
     // try to find nondenom first to prevent unneeded spending of mixed coins
     for (unsigned int tryDenom = 0; tryDenom < 2; tryDenom++)
     {
@@ -2512,15 +2679,11 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
         nTotalLower = 0;
         BOOST_FOREACH(const COutput &output, vCoins)
         {
-            if (!output.fSpendable)
+            if (!IsEligibleForSelection(output, nConfMine, nConfTheirs))
                 continue;
 
             const CWalletTx *pcoin = output.tx;
 
-//            if (fDebug) LogPrint("selectcoins", "value %s confirms %d\n", FormatMoney(pcoin->vout[output.i].nValue), output.nDepth);
-            if (output.nDepth < (pcoin->IsFromMe(ISMINE_ALL) ? nConfMine : nConfTheirs))
-                continue;
-
             int i = output.i;
             CAmount n = pcoin->vout[i].nValue;
             if (tryDenom == 0 && CPrivateSend::IsDenominatedAmount(n)) continue; // we don't want denom values on first run
@@ -2575,11 +2738,29 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
 
     }
 
-    // Solve subset sum by stochastic approximation
     sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
     vector<char> vfBest;
     CAmount nBest;
 
+    // Look for a changeless solution first
+    if ((!fUseInstantSend || nTargetValue <= sporkManager.GetSporkValue(SPORK_5_INSTANTSEND_MAX_VALUE)*COIN) &&
+        SelectCoinsBnB(vValue, nTargetValue, vfBest))
+    {
+        string s = "CWallet::SelectCoinsMinConf exact subset: ";
+        for (unsigned int i = 0; i < vValue.size(); i++)
+        {
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+                s += FormatMoney(vValue[i].first) + " ";
+            }
+        }
+        LogPrint("selectcoins", "%s - total %s\n", s, FormatMoney(nValueRet));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation
     ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, fUseInstantSend);
     if (nBest != nTargetValue && nTotalLower >= nTargetValue + MIN_CHANGE)
         ApproximateBestSubset(vValue, nTotalLower, nTargetValue + MIN_CHANGE, vfBest, nBest, fUseInstantSend);
@@ -2690,10 +2871,26 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
             ++it;
     }
 
-    bool res = nTargetValue <= nValueFromPresetInputs ||
-        SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, 1, 6, vCoins, setCoinsRet, nValueRet, fUseInstantSend) ||
-        SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, 1, 1, vCoins, setCoinsRet, nValueRet, fUseInstantSend) ||
-        (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, 0, 1, vCoins, setCoinsRet, nValueRet, fUseInstantSend));
+    // Try confirmed coins first and widen the set of eligible coins step by step. The coins
+    // are shuffled and sorted once for all steps. Each step only adds coins, so a step that
+    // doesn't make any new coin eligible would fail just like the previous one and is skipped.
+    static const int nConfSteps[3][2] = {{1, 6}, {1, 1}, {0, 1}};
+    const int nSteps = bSpendZeroConfChange ? 3 : 2;
+    SortCoinsForSelection(vCoins);
+
+    bool res = nTargetValue <= nValueFromPresetInputs;
+    size_t nEligiblePrev = 0;
+    for (int nStep = 0; nStep < nSteps && !res; nStep++)
+    {
+        size_t nEligible = 0;
+        BOOST_FOREACH(const COutput& out, vCoins)
+            if (IsEligibleForSelection(out, nConfSteps[nStep][0], nConfSteps[nStep][1]))
+                nEligible++;
+        if (nStep > 0 && nEligible == nEligiblePrev)
+            continue;
+        nEligiblePrev = nEligible;
+        res = SelectCoinsMinConfSorted(nTargetValue - nValueFromPresetInputs, nConfSteps[nStep][0], nConfSteps[nStep][1], vCoins, setCoinsRet, nValueRet, fUseInstantSend);
+    }
 
     // because SelectCoinsMinConf clears the setCoinsRet, we now add the possible inputs to the coinset
     setCoinsRet.insert(setPresetCoins.begin(), setPresetCoins.end());
@@ -3615,11 +3812,7 @@ DBErrors CWallet::LoadWallet(bool& fFirstRunRet)
     {
         LOCK2(cs_main, cs_wallet);
         for (auto& pair : mapWallet) {
-            for(unsigned int i = 0; i < pair.second.vout.size(); ++i) {
-                if (IsMine(pair.second.vout[i]) && !IsSpent(pair.first, i)) {
-                    setWalletUTXO.insert(COutPoint(pair.first, i));
-                }
-            }
+            AddToWalletUTXO(pair.second);
         }
     }
 
@@ -4178,6 +4371,7 @@ void CWallet::LockCoin(COutPoint& output)
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
 }
 
 void CWallet::UnlockCoin(COutPoint& output)
@@ -4189,6 +4383,7 @@ void CWallet::UnlockCoin(COutPoint& output)
 
     fAnonymizableTallyCached = false;
     fAnonymizableTallyCachedNonDenom = false;
+    fBalancesCached = false;
 }
 
 void CWallet::UnlockAllCoins()
@@ -4372,7 +4567,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size())
     {
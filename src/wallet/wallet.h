@@ -71,6 +71,9 @@ static const CAmount MASTERNODE_PRICE = 10000;
 //! if set, all keys will be derived by using BIP39/BIP44
 static const bool DEFAULT_USE_HD_WALLET = false;
 
+//! Maximum number of PrivateSend rounds tracked for a single outpoint
+static const int MAX_PRIVATESEND_ROUNDS = 16;
+
 class CBlockIndex;
 class CCoinControl;
 class COutput;
@@ -112,6 +115,32 @@ struct CompactTallyItem
     }
 };
 
+/** Balances of a wallet, see CWallet::GetBalances() */
+struct CWalletBalances
+{
+    CAmount nBalance;
+    CAmount nUnconfirmedBalance;
+    CAmount nImmatureBalance;
+    CAmount nWatchOnlyBalance;
+    CAmount nUnconfirmedWatchOnlyBalance;
+    CAmount nImmatureWatchOnlyBalance;
+    CAmount nAnonymizedBalance;
+    CAmount nDenominatedBalance;
+    CAmount nUnconfirmedDenominatedBalance;
+    CWalletBalances()
+    {
+        nBalance = 0;
+        nUnconfirmedBalance = 0;
+        nImmatureBalance = 0;
+        nWatchOnlyBalance = 0;
+        nUnconfirmedWatchOnlyBalance = 0;
+        nImmatureWatchOnlyBalance = 0;
+        nAnonymizedBalance = 0;
+        nDenominatedBalance = 0;
+        nUnconfirmedDenominatedBalance = 0;
+    }
+};
+
 /** A key pool entry */
 class CKeyPool
 {
@@ -644,7 +673,43 @@ private:
     void AddToSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /**
+     * Our outputs which are (potentially) unspent. Outputs are added when their
+     * transaction is added or updated and when a transaction spending them gets
+     * abandoned or conflicted, and removed once a wallet transaction spends them.
+     * Balances and AvailableCoins() only look at transactions found here instead
+     * of walking the whole of mapWallet.
+     */
     std::set<COutPoint> setWalletUTXO;
+    void AddToWalletUTXO(const CWalletTx& wtx);
+    /** Wallet transactions with at least one output in setWalletUTXO, in mapWallet order */
+    void GetWalletUTXOTxes(std::vector<const CWalletTx*>& vWalletTxesRet) const;
+
+    /**
+     * Balances computed by GetBalances(). Besides the wallet itself they depend on
+     * the active chain tip, the mempool and InstantSend locks, so they are only
+     * reused while neither the tip nor the mempool has changed and no wallet
+     * transaction or lock has been updated since they were computed.
+     */
+    mutable bool fBalancesCached;
+    mutable uint256 hashBalancesCachedTip;
+    mutable unsigned int nBalancesCachedMempoolUpdated;
+    mutable CWalletBalances balancesCached;
+
+    /**
+     * PrivateSend rounds of our outpoints, filled by GetRealOutpointPrivateSendRounds().
+     * Rounds only depend on the in-wallet ancestry of an outpoint, so entries are dropped
+     * when a transaction is added which is (an ancestor of) the transaction they belong to,
+     * and all of them when outputs may have become ours.
+     */
+    mutable std::map<COutPoint, int> mapOutpointRoundsCache;
+    /**
+     * "psrounds" records not written to the wallet file yet, a negative value erases the
+     * record. Only unspent denominated outputs of ours are kept in the wallet file.
+     */
+    mutable std::map<COutPoint, int> mapOutpointRoundsToWrite;
+    void InvalidatePrivateSendRounds(const uint256& hashTx);
+    void ClearPrivateSendRounds();
 
     /* Mark a transaction (and its in-wallet descendants) as conflicting with a particular block. */
     void MarkConflicted(const uint256& hashBlock, const uint256& hashTx);
@@ -726,6 +791,10 @@ public:
         fAnonymizableTallyCachedNonDenom = false;
         vecAnonymizableTallyCached.clear();
         vecAnonymizableTallyCachedNonDenom.clear();
+        mapOutpointRoundsCache.clear();
+        mapOutpointRoundsToWrite.clear();
+        fBalancesCached = false;
+        nBalancesCachedMempoolUpdated = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -761,11 +830,14 @@ public:
 
     /**
      * Shuffle and select coins until nTargetValue is reached while avoiding
-     * small change; This method is stochastic for some inputs and upon
-     * completion the coin set and corresponding actual target value is
-     * assembled
+     * small change; A subset matching nTargetValue exactly is searched for
+     * first (branch and bound), otherwise this method is stochastic for some
+     * inputs and upon completion the coin set and corresponding actual target
+     * value is assembled
      */
     bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseInstantSend = false) const;
+    /** Same as SelectCoinsMinConf() for coins that are already shuffled and sorted for selection */
+    bool SelectCoinsMinConfSorted(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, bool fUseInstantSend = false) const;
 
     // Coin selection
     bool SelectCoinsByDenominations(int nDenom, CAmount nValueMin, CAmount nValueMax, std::vector<CTxDSIn>& vecTxDSInRet, std::vector<COutput>& vCoinsRet, CAmount& nValueRet, int nPrivateSendRoundsMin, int nPrivateSendRoundsMax);
@@ -783,7 +855,11 @@ public:
     int  CountInputsWithAmount(CAmount nInputAmount);
 
     // get the PrivateSend chain depth for a given input
-    int GetRealOutpointPrivateSendRounds(const COutPoint& outpoint, int nRounds) const;
+    int GetRealOutpointPrivateSendRounds(const COutPoint& outpoint) const;
+    //! Adds cached PrivateSend rounds of an outpoint, without saving them to disk (used by LoadWallet)
+    void LoadPrivateSendRounds(const COutPoint& outpoint, int nRounds);
+    //! Writes the changed PrivateSend rounds to the wallet file in one batch
+    void WritePrivateSendRounds();
     // respect current settings
     int GetOutpointPrivateSendRounds(const COutPoint& outpoint) const;
 
@@ -857,12 +933,14 @@ public:
 
     void MarkDirty();
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
-    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+    void SyncTransaction(const CTransactionRef& ptx, const CBlock* pblock);
+    void NotifyTransactionLock(const CTransaction& tx);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman);
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime, CConnman* connman);
+    const CWalletBalances& GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;